@@ -0,0 +1,116 @@
+/* Times the rtArray.c kernels against plain per-element loops on arrays
+   of 1K up to 100M ints (or the size given as the first argument).
+
+     gcc -O2 -o arrayBench bench/arrayBench.c rtArray.c
+     ./arrayBench [max-elements]
+
+   Every size runs about the same total number of elements, and both
+   versions must agree on every result. */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int rt_find_i32(const int *data, int length, int value);
+int rt_max_i32(const int *data, int length);
+
+/* noinline keeps the loops from being specialised for the call site */
+__attribute__((noinline)) static int naive_find(const int *data, int length, int value)
+{
+    for (int i = 0; i < length; i++)
+        if (data[i] == value)
+            return i;
+    return -1;
+}
+
+__attribute__((noinline)) static int naive_max(const int *data, int length)
+{
+    int max = INT_MIN;
+    for (int i = 0; i < length; i++)
+        if (data[i] > max)
+            max = data[i];
+    return max;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Makes the compiler assume the array changed, so repeated calls with the
+   same arguments are not merged */
+#define CLOBBER(p) __asm__ volatile("" : : "r"(p) : "memory")
+
+/* Elements processed per size, split into as many repetitions as fit */
+#define WORK 400000000LL
+
+int main(int argc, char **argv)
+{
+    long long limit = argc > 1 ? atoll(argv[1]) : 100000000LL;
+    int *data = malloc(limit * sizeof(int));
+    if (!data)
+    {
+        fprintf(stderr, "cannot allocate %lld elements\n", limit);
+        return 1;
+    }
+    srand(1);
+    for (long long i = 0; i < limit; i++)
+        data[i] = rand() % 1000000;
+
+    printf("%12s %14s %14s %8s %14s %14s %8s\n", "elements", "find naive", "find rt",
+           "speedup", "max naive", "max rt", "speedup");
+    for (long long n = 1000; n <= limit; n *= 10)
+    {
+        int reps = WORK / n > 0 ? (int)(WORK / n) : 1;
+        /* The needle sits in the last element so find scans everything */
+        int saved = data[n - 1];
+        data[n - 1] = -1;
+
+        double t[4];
+        long long check[4] = {0, 0, 0, 0};
+        double start = now();
+        for (int r = 0; r < reps; r++)
+        {
+            CLOBBER(data);
+            check[0] += naive_find(data, n, -1);
+        }
+        t[0] = now() - start;
+        start = now();
+        for (int r = 0; r < reps; r++)
+        {
+            CLOBBER(data);
+            check[1] += rt_find_i32(data, n, -1);
+        }
+        t[1] = now() - start;
+        start = now();
+        for (int r = 0; r < reps; r++)
+        {
+            CLOBBER(data);
+            check[2] += naive_max(data, n);
+        }
+        t[2] = now() - start;
+        start = now();
+        for (int r = 0; r < reps; r++)
+        {
+            CLOBBER(data);
+            check[3] += rt_max_i32(data, n);
+        }
+        t[3] = now() - start;
+        data[n - 1] = saved;
+
+        if (check[0] != check[1] || check[2] != check[3])
+        {
+            fprintf(stderr, "results differ at %lld elements\n", n);
+            return 1;
+        }
+        /* Nanoseconds per element */
+        double scale = 1e9 / ((double)n * reps);
+        printf("%12lld %11.3f ns %11.3f ns %7.1fx %11.3f ns %11.3f ns %7.1fx\n", n,
+               t[0] * scale, t[1] * scale, t[0] / t[1], t[2] * scale, t[3] * scale,
+               t[2] / t[3]);
+    }
+    free(data);
+    return 0;
+}
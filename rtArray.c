@@ -0,0 +1,254 @@
+/* Array runtime: the allocator for array buffers and the kernels behind
+   the find and max builtins. Each kernel has a scalar version and, on x86,
+   SSE and AVX2 versions; the best one the CPU supports is picked once at
+   startup. */
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RT_X86 1
+#include <immintrin.h>
+#endif
+
+/* Arrays are bump-allocated from per-thread regions. A region is a stack
+   of chunks mapped on 2 MiB boundaries so they can be backed by huge pages.
+   Nothing is freed one array at a time: rt_region_release pops everything
+   allocated since a mark, and the rest goes away at exit. Popped chunks
+   are kept for reuse. */
+#define RT_CHUNK_ALIGN ((size_t)2 << 20)
+/* Buffers are aligned for the AVX2 kernels */
+#define RT_ALLOC_ALIGN 32
+
+struct rt_chunk
+{
+    struct rt_chunk *prev;
+    char *end;
+};
+
+static _Thread_local char *rt_region_pos;
+static _Thread_local char *rt_region_end;
+static _Thread_local struct rt_chunk *rt_region_top;
+static _Thread_local struct rt_chunk *rt_region_spare;
+static _Thread_local unsigned rt_region_chunks;
+
+static char *rt_chunk_data(struct rt_chunk *chunk)
+{
+    return (char *)chunk + RT_ALLOC_ALIGN;
+}
+
+static struct rt_chunk *rt_chunk_map(size_t size)
+{
+    /* Map one alignment unit extra and trim both ends to the boundary */
+    char *raw = mmap(NULL, size + RT_CHUNK_ALIGN, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        fprintf(stderr, "Out of memory allocating an array\n");
+        exit(1);
+    }
+    char *base = (char *)(((uintptr_t)raw + RT_CHUNK_ALIGN - 1) & ~(RT_CHUNK_ALIGN - 1));
+    if (base != raw)
+        munmap(raw, base - raw);
+    if (base + size != raw + size + RT_CHUNK_ALIGN)
+        munmap(base + size, raw + RT_CHUNK_ALIGN - base);
+#ifdef MADV_HUGEPAGE
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    struct rt_chunk *chunk = (struct rt_chunk *)base;
+    chunk->end = base + size;
+    return chunk;
+}
+
+/* Pushes a chunk with room for bytes and allocates them from it. */
+static void *rt_region_grow(size_t bytes)
+{
+    struct rt_chunk **link = &rt_region_spare;
+    while (*link && (size_t)((*link)->end - rt_chunk_data(*link)) < bytes)
+        link = &(*link)->prev;
+    struct rt_chunk *chunk = *link;
+    if (chunk)
+    {
+        *link = chunk->prev;
+    }
+    else
+    {
+        /* Chunks double up to 64 MiB so big programs map rarely */
+        unsigned shift = rt_region_chunks < 5 ? rt_region_chunks : 5;
+        size_t size = RT_CHUNK_ALIGN << shift;
+        size_t needed = (bytes + RT_ALLOC_ALIGN + RT_CHUNK_ALIGN - 1) & ~(RT_CHUNK_ALIGN - 1);
+        chunk = rt_chunk_map(needed > size ? needed : size);
+        rt_region_chunks++;
+    }
+    chunk->prev = rt_region_top;
+    rt_region_top = chunk;
+    rt_region_pos = rt_chunk_data(chunk) + bytes;
+    rt_region_end = chunk->end;
+    return rt_chunk_data(chunk);
+}
+
+void *rt_alloc(size_t bytes)
+{
+    bytes = (bytes + RT_ALLOC_ALIGN - 1) & ~(size_t)(RT_ALLOC_ALIGN - 1);
+    char *p = rt_region_pos;
+    if ((size_t)(rt_region_end - p) >= bytes)
+    {
+        rt_region_pos = p + bytes;
+        return p;
+    }
+    return rt_region_grow(bytes);
+}
+
+void *rt_region_mark(void)
+{
+    return rt_region_pos;
+}
+
+/* Frees everything allocated since mark was taken. */
+void rt_region_release(void *mark)
+{
+    char *pos = mark;
+    while (rt_region_top &&
+           (pos < rt_chunk_data(rt_region_top) || pos > rt_region_top->end))
+    {
+        struct rt_chunk *chunk = rt_region_top;
+        rt_region_top = chunk->prev;
+        chunk->prev = rt_region_spare;
+        rt_region_spare = chunk;
+    }
+    rt_region_pos = rt_region_top ? pos : NULL;
+    rt_region_end = rt_region_top ? rt_region_top->end : NULL;
+}
+
+typedef int (*rt_find_fn)(const int *, int, int);
+typedef int (*rt_max_fn)(const int *, int);
+
+static int rt_find_scalar(const int *data, int length, int value)
+{
+    for (int i = 0; i < length; i++)
+        if (data[i] == value)
+            return i;
+    return -1;
+}
+
+static int rt_max_scalar(const int *data, int length)
+{
+    int max = INT_MIN;
+    for (int i = 0; i < length; i++)
+        max = data[i] > max ? data[i] : max;
+    return max;
+}
+
+#ifdef RT_X86
+/* The first match is picked out of the comparison mask */
+__attribute__((target("sse2"))) static int rt_find_sse2(const int *data, int length,
+                                                         int value)
+{
+    __m128i needle = _mm_set1_epi32(value);
+    int i = 0;
+    for (; i + 4 <= length; i += 4)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, needle)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    int rest = rt_find_scalar(data + i, length - i, value);
+    return rest < 0 ? -1 : i + rest;
+}
+
+/* Sixteen elements per step; the two masks are only told apart once one
+   of them has a match */
+__attribute__((target("avx2"))) static int rt_find_avx2(const int *data, int length,
+                                                         int value)
+{
+    __m256i needle = _mm256_set1_epi32(value);
+    int i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m256i lo = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(data + i)), needle);
+        __m256i hi =
+            _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(data + i + 8)), needle);
+        if (_mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi)))
+            continue;
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(lo));
+        if (mask)
+            return i + __builtin_ctz(mask);
+        return i + 8 + __builtin_ctz(_mm256_movemask_ps(_mm256_castsi256_ps(hi)));
+    }
+    int rest = rt_find_sse2(data + i, length - i, value);
+    return rest < 0 ? -1 : i + rest;
+}
+
+__attribute__((target("sse4.1"))) static int rt_max_sse41(const int *data, int length)
+{
+    __m128i a = _mm_set1_epi32(INT_MIN), b = a;
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        a = _mm_max_epi32(a, _mm_loadu_si128((const __m128i *)(data + i)));
+        b = _mm_max_epi32(b, _mm_loadu_si128((const __m128i *)(data + i + 4)));
+    }
+    a = _mm_max_epi32(a, b);
+    a = _mm_max_epi32(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2)));
+    a = _mm_max_epi32(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)));
+    int max = _mm_cvtsi128_si32(a);
+    int rest = rt_max_scalar(data + i, length - i);
+    return rest > max ? rest : max;
+}
+
+/* Four independent accumulators hide the latency of vpmaxsd */
+__attribute__((target("avx2"))) static int rt_max_avx2(const int *data, int length)
+{
+    __m256i a = _mm256_set1_epi32(INT_MIN), b = a, c = a, d = a;
+    int i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        a = _mm256_max_epi32(a, _mm256_loadu_si256((const __m256i *)(data + i)));
+        b = _mm256_max_epi32(b, _mm256_loadu_si256((const __m256i *)(data + i + 8)));
+        c = _mm256_max_epi32(c, _mm256_loadu_si256((const __m256i *)(data + i + 16)));
+        d = _mm256_max_epi32(d, _mm256_loadu_si256((const __m256i *)(data + i + 24)));
+    }
+    a = _mm256_max_epi32(_mm256_max_epi32(a, b), _mm256_max_epi32(c, d));
+    __m128i m = _mm_max_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+    m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    int max = _mm_cvtsi128_si32(m);
+    int rest = rt_max_sse41(data + i, length - i);
+    return rest > max ? rest : max;
+}
+#endif
+
+static rt_find_fn rt_find_impl = rt_find_scalar;
+static rt_max_fn rt_max_impl = rt_max_scalar;
+
+__attribute__((constructor)) static void rt_array_init(void)
+{
+#ifdef RT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        rt_find_impl = rt_find_avx2;
+        rt_max_impl = rt_max_avx2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse2"))
+        rt_find_impl = rt_find_sse2;
+    if (__builtin_cpu_supports("sse4.1"))
+        rt_max_impl = rt_max_sse41;
+#endif
+}
+
+/* Position of the first element equal to value, or -1. */
+int rt_find_i32(const int *data, int length, int value)
+{
+    return rt_find_impl(data, length, value);
+}
+
+/* Largest element, or INT_MIN for an empty array. */
+int rt_max_i32(const int *data, int length)
+{
+    return rt_max_impl(data, length);
+}
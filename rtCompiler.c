@@ -1,21 +1,468 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Output of print statements collects here and goes to stdout in large
+   writes: when the buffer fills, before reading input and at exit. */
+#define RT_OUT_SIZE (1 << 16)
+/* Room for the longest line either print routine writes without snprintf */
+#define RT_MAX_LINE 32
+
+static char rt_out[RT_OUT_SIZE];
+static size_t rt_out_len;
+static int rt_out_registered;
+
+/* With rt_async_output the full print buffer is handed to this ring
+   instead, and an I/O thread drains it with write(2). The program is the
+   only producer and the thread the only consumer, so the two positions
+   are all the synchronisation needed. They count bytes ever written and
+   only wrap when used as offsets. */
+#define RT_RING_SIZE (1 << 22)
+
+static char rt_ring[RT_RING_SIZE];
+static atomic_size_t rt_ring_head;
+static atomic_size_t rt_ring_tail;
+static atomic_int rt_ring_stop;
+static int rt_async;
+static pthread_t rt_io_thread;
+
+static void rt_pause(void)
+{
+    struct timespec ts = {0, 20000};
+    nanosleep(&ts, NULL);
+}
+
+static void rt_write_all(const char *p, size_t n)
+{
+    while (n)
+    {
+        ssize_t written = write(STDOUT_FILENO, p, n);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        p += written;
+        n -= written;
+    }
+}
+
+static void rt_ring_push(const char *p, size_t n)
+{
+    size_t head = atomic_load_explicit(&rt_ring_head, memory_order_relaxed);
+    while (n)
+    {
+        size_t tail = atomic_load_explicit(&rt_ring_tail, memory_order_acquire);
+        size_t space = RT_RING_SIZE - (head - tail);
+        if (!space)
+        {
+            rt_pause();
+            continue;
+        }
+        size_t offset = head & (RT_RING_SIZE - 1);
+        size_t chunk = n < space ? n : space;
+        if (chunk > RT_RING_SIZE - offset)
+            chunk = RT_RING_SIZE - offset;
+        memcpy(rt_ring + offset, p, chunk);
+        head += chunk;
+        p += chunk;
+        n -= chunk;
+        atomic_store_explicit(&rt_ring_head, head, memory_order_release);
+    }
+}
+
+static void *rt_io_main(void *arg)
+{
+    size_t tail = atomic_load_explicit(&rt_ring_tail, memory_order_relaxed);
+    (void)arg;
+    for (;;)
+    {
+        size_t head = atomic_load_explicit(&rt_ring_head, memory_order_acquire);
+        if (head == tail)
+        {
+            /* The last bytes are published before the stop flag is set */
+            if (atomic_load(&rt_ring_stop) &&
+                atomic_load_explicit(&rt_ring_head, memory_order_acquire) == tail)
+                return NULL;
+            rt_pause();
+            continue;
+        }
+        size_t offset = tail & (RT_RING_SIZE - 1);
+        size_t chunk = head - tail;
+        if (chunk > RT_RING_SIZE - offset)
+            chunk = RT_RING_SIZE - offset;
+        rt_write_all(rt_ring + offset, chunk);
+        tail += chunk;
+        atomic_store_explicit(&rt_ring_tail, tail, memory_order_release);
+    }
+}
+
+/* Sends the print buffer on its way without waiting for it to be written. */
+static void rt_publish(void)
+{
+    if (rt_async)
+        rt_ring_push(rt_out, rt_out_len);
+    else
+        fwrite(rt_out, 1, rt_out_len, stdout);
+    rt_out_len = 0;
+}
+
+/* Writes out everything printed so far. */
+void rt_flush(void)
+{
+    rt_publish();
+    if (!rt_async)
+    {
+        fflush(stdout);
+        return;
+    }
+    size_t head = atomic_load_explicit(&rt_ring_head, memory_order_relaxed);
+    while (atomic_load_explicit(&rt_ring_tail, memory_order_acquire) != head)
+        rt_pause();
+}
+
+static void rt_async_stop(void)
+{
+    rt_publish();
+    atomic_store(&rt_ring_stop, 1);
+    pthread_join(rt_io_thread, NULL);
+    rt_async = 0;
+}
+
+/* On a fatal signal the I/O thread gets a moment to write what it was
+   given, then the rest of the print buffer goes out directly. Only
+   async-signal-safe calls are made before the signal is raised again. */
+static void rt_async_fatal(int sig)
+{
+    size_t head = atomic_load(&rt_ring_head);
+    for (int i = 0; i < 100000 && atomic_load(&rt_ring_tail) != head; i++)
+        rt_pause();
+    rt_write_all(rt_out, rt_out_len);
+    raise(sig);
+}
+
+/* Called first thing in main when the program was compiled with
+   --async-output. Printing stays synchronous if no thread can be started. */
+void rt_async_output(void)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    /* Fatal signals must reach the program thread, never the I/O thread */
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int failed = pthread_create(&rt_io_thread, NULL, rt_io_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (failed)
+        return;
+
+    rt_async = 1;
+    atexit(rt_async_stop);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = rt_async_fatal;
+    sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+    int fatal[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGINT, SIGTERM};
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++)
+        sigaction(fatal[i], &sa, NULL);
+}
+
+/* Returns space for at least n more bytes. */
+static char *rt_reserve(size_t n)
+{
+    if (!rt_out_registered)
+    {
+        atexit(rt_flush);
+        rt_out_registered = 1;
+    }
+    if (RT_OUT_SIZE - rt_out_len < n)
+        rt_publish();
+    return rt_out + rt_out_len;
+}
+
+/* Writes the decimal digits of v backwards, ending just before end. */
+static char *rt_format_u64(char *end, unsigned long long v)
+{
+    do
+    {
+        *--end = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    return end;
+}
+
+void rt_print_i32(int v)
+{
+    char digits[16];
+    char *end = digits + sizeof(digits);
+    unsigned int mag = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+    char *p = rt_format_u64(end, mag);
+    if (v < 0)
+        *--p = '-';
+
+    char *out = rt_reserve(RT_MAX_LINE);
+    size_t n = end - p;
+    memcpy(out, p, n);
+    out[n] = '\n';
+    rt_out_len += n + 1;
+}
+
+/* Prints v like printf("%f\n"). The value is scaled to millionths in one
+   multiply; when that product cannot have been rounded across a .5
+   boundary the digits come straight from it, otherwise snprintf decides. */
+void rt_print_f64(double v)
+{
+    double mag = fabs(v);
+    double scaled = mag * 1e6;
+    if (scaled < 0x1p52)
+    {
+        double units = nearbyint(scaled);
+        double slack = scaled * 0x1p-51;
+        if (fabs(fabs(scaled - units) - 0.5) > slack)
+        {
+            unsigned long long fixed = (unsigned long long)units;
+            char digits[24];
+            char *end = digits + sizeof(digits);
+            char *p = end;
+            for (int i = 0; i < 6; i++)
+            {
+                *--p = '0' + fixed % 10;
+                fixed /= 10;
+            }
+            *--p = '.';
+            p = rt_format_u64(p, fixed);
+            if (signbit(v))
+                *--p = '-';
+
+            char *out = rt_reserve(RT_MAX_LINE);
+            size_t n = end - p;
+            memcpy(out, p, n);
+            out[n] = '\n';
+            rt_out_len += n + 1;
+            return;
+        }
+    }
+
+    /* Large values, ties and inf/nan; %f of a double is at most 317 chars */
+    char *out = rt_reserve(330);
+    rt_out_len += snprintf(out, 330, "%f\n", v);
+}
 
 void compiler_write(int v)
 {
     printf("The result is: %d\n", v);
 }
 
-int compiler_read(char *s)
+void rt_bounds_fail(int index, int length)
 {
-    char buf[64];
-    int val;
-    printf("Enter a value for %s: ", s);
-    fgets(buf, sizeof(buf), stdin);
-    if (EOF == sscanf(buf, "%d", &val))
+    rt_flush();
+    fprintf(stderr, "Array index %d out of bounds for length %d\n", index, length);
+    exit(1);
+}
+
+void rt_length_fail(int left, int right)
+{
+    rt_flush();
+    fprintf(stderr, "Array lengths %d and %d differ in element-wise operation\n", left, right);
+    exit(1);
+}
+
+void rt_slice_fail(int lo, int hi, int length)
+{
+    rt_flush();
+    fprintf(stderr, "Slice [%d:%d] out of bounds for length %d\n", lo, hi, length);
+    exit(1);
+}
+
+/* Input of the read builtins. A regular file on stdin is mapped whole;
+   anything else is read in large blocks. Values are parsed straight out of
+   the block, so a token may only be split where the block ends. */
+#define RT_IN_SIZE (1 << 20)
+
+static char rt_in_block[RT_IN_SIZE];
+static const char *rt_in_pos;
+static const char *rt_in_end;
+static int rt_in_started;
+static int rt_in_mapped;
+
+/* Makes more input available; returns 0 at end of input. */
+static int rt_in_fill(void)
+{
+    if (!rt_in_started)
     {
-        printf("Value %s is invalid\n", buf);
-        exit(1);
+        rt_in_started = 1;
+        struct stat st;
+        off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        if (offset >= 0 && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size > offset)
+        {
+            void *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+            if (file != MAP_FAILED)
+            {
+                rt_in_mapped = 1;
+                rt_in_pos = (const char *)file + offset;
+                rt_in_end = (const char *)file + st.st_size;
+                return 1;
+            }
+        }
     }
-    return val;
-}
\ No newline at end of file
+    if (rt_in_mapped)
+        return 0;
+
+    ssize_t n;
+    do
+        n = read(STDIN_FILENO, rt_in_block, RT_IN_SIZE);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return 0;
+    rt_in_pos = rt_in_block;
+    rt_in_end = rt_in_block + n;
+    return 1;
+}
+
+/* The next input character without consuming it, or -1 at end of input. */
+static inline int rt_in_peek(void)
+{
+    if (rt_in_pos == rt_in_end && !rt_in_fill())
+        return -1;
+    return (unsigned char)*rt_in_pos;
+}
+
+static int rt_in_skip_space(void)
+{
+    int c;
+    while ((c = rt_in_peek()) == ' ' || c == '\n' || c == '\t' || c == '\r')
+        rt_in_pos++;
+    return c;
+}
+
+static void rt_read_fail(const char *what)
+{
+    rt_flush();
+    fprintf(stderr, "Expected %s on input\n", what);
+    exit(1);
+}
+
+/* Reads a decimal integer; values outside int wrap like int arithmetic. */
+int rt_read_i32(void)
+{
+    int c = rt_in_skip_space();
+    int negative = c == '-';
+    if (c == '-' || c == '+')
+    {
+        rt_in_pos++;
+        c = rt_in_peek();
+    }
+    if (c < '0' || c > '9')
+        rt_read_fail("an integer");
+
+    unsigned int v = 0;
+    do
+    {
+        v = v * 10 + (c - '0');
+        rt_in_pos++;
+        c = rt_in_peek();
+    } while (c >= '0' && c <= '9');
+    return (int)(negative ? 0u - v : v);
+}
+
+/* A decimal with at most 2^53 as its digits and a power of ten up to 22
+   either way converts exactly with one multiply or divide. Returns 0 for
+   anything else. */
+static int rt_parse_f64_fast(const char *s, double *out)
+{
+    static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                   1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                   1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    int negative = *s == '-';
+    if (*s == '-' || *s == '+')
+        s++;
+
+    unsigned long long digits = 0;
+    int scale = 0, seen = 0, point = 0;
+    for (;; s++)
+    {
+        if (*s == '.' && !point)
+        {
+            point = 1;
+            continue;
+        }
+        if (*s < '0' || *s > '9')
+            break;
+        if (digits > ((1ull << 53) - 9) / 10)
+            return 0;
+        digits = digits * 10 + (*s - '0');
+        scale -= point;
+        seen = 1;
+    }
+    if (!seen)
+        return 0;
+    if (*s == 'e' || *s == 'E')
+    {
+        s++;
+        int exp_negative = *s == '-';
+        if (*s == '-' || *s == '+')
+            s++;
+        if (*s < '0' || *s > '9')
+            return 0;
+        int exp = 0;
+        for (; *s >= '0' && *s <= '9' && exp < 1000; s++)
+            exp = exp * 10 + (*s - '0');
+        scale += exp_negative ? -exp : exp;
+    }
+    if (*s || scale < -22 || scale > 22)
+        return 0;
+
+    double v = (double)digits;
+    v = scale < 0 ? v / pow10[-scale] : v * pow10[scale];
+    *out = negative ? -v : v;
+    return 1;
+}
+
+double rt_read_f64(void)
+{
+    char token[128];
+    size_t n = 0;
+    int c = rt_in_skip_space();
+    while (c != -1 && c != ' ' && c != '\n' && c != '\t' && c != '\r')
+    {
+        if (n == sizeof(token) - 1)
+            rt_read_fail("a number");
+        token[n++] = (char)c;
+        rt_in_pos++;
+        c = rt_in_peek();
+    }
+    token[n] = '\0';
+
+    double v;
+    if (rt_parse_f64_fast(token, &v))
+        return v;
+    char *end;
+    v = strtod(token, &end);
+    if (!n || *end)
+        rt_read_fail("a number");
+    return v;
+}
+
+void rt_read_array_i32(int *data, int n)
+{
+    for (int i = 0; i < n; i++)
+        data[i] = rt_read_i32();
+}
+
+int compiler_read(char *s)
+{
+    rt_flush();
+    printf("Enter a value for %s: ", s);
+    fflush(stdout);
+    return rt_read_i32();
+}
@@ -0,0 +1,254 @@
+/* Parallel runtime: the scheduler behind parallel foreach and the loops
+   --auto-parallel picks. The compiler outlines the loop body into a
+   function over a range of indices, and rt_parallel_for runs it over
+   0..length on a pool of threads.
+
+   Every thread owns a range of indices and takes grain-sized chunks from
+   its front. A thread whose range is empty steals the back half of
+   another's, so uneven bodies still keep every core busy. The calling
+   thread takes part, and loops started inside a parallel body simply run
+   on the thread that reached them. */
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define rt_cpu_relax() _mm_pause()
+#else
+#define rt_cpu_relax() ((void)0)
+#endif
+
+#define RT_MAX_THREADS 256
+/* Polls of the job counter before a worker goes to sleep */
+#define RT_SPIN 4000
+
+/* thread is below rt_parallel_threads(); the compiler keeps partial
+   results per thread with it */
+typedef void (*rt_body_fn)(void *env, int begin, int end, int thread);
+
+/* A range packs begin into the low and end into the high 32 bits, so owner
+   and thieves agree on it with one compare-and-swap. Each sits on its own
+   cache line. */
+struct rt_range
+{
+    _Alignas(64) _Atomic uint64_t bounds;
+};
+
+static struct rt_range rt_ranges[RT_MAX_THREADS];
+static int rt_threads;
+static unsigned rt_grain;
+
+/* The current job */
+static rt_body_fn rt_job_fn;
+static void *rt_job_env;
+static _Atomic int64_t rt_job_remaining;
+static _Atomic unsigned rt_job_epoch;
+static _Atomic int rt_job_busy;
+
+static pthread_mutex_t rt_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rt_job_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rt_job_done = PTHREAD_COND_INITIALIZER;
+static pthread_once_t rt_pool_once = PTHREAD_ONCE_INIT;
+
+/* Set on threads running a parallel body */
+static _Thread_local int rt_in_parallel;
+
+static uint64_t rt_pack(unsigned begin, unsigned end)
+{
+    return (uint64_t)end << 32 | begin;
+}
+
+/* Runs the next chunk of this thread's range; 0 once it is empty. */
+static int rt_run_own(int self)
+{
+    _Atomic uint64_t *bounds = &rt_ranges[self].bounds;
+    uint64_t r = atomic_load_explicit(bounds, memory_order_relaxed);
+    for (;;)
+    {
+        unsigned begin = (unsigned)r, end = (unsigned)(r >> 32);
+        if (begin >= end)
+            return 0;
+        unsigned next = end - begin > rt_grain ? begin + rt_grain : end;
+        if (atomic_compare_exchange_weak_explicit(bounds, &r, rt_pack(next, end),
+                                                  memory_order_acquire, memory_order_relaxed))
+        {
+            rt_job_fn(rt_job_env, (int)begin, (int)next, self);
+            atomic_fetch_sub_explicit(&rt_job_remaining, next - begin, memory_order_release);
+            return 1;
+        }
+    }
+}
+
+/* Moves the back half of some other thread's range into this one's. */
+static int rt_steal(int self)
+{
+    for (int i = 1; i < rt_threads; i++)
+    {
+        int victim = (self + i) % rt_threads;
+        _Atomic uint64_t *bounds = &rt_ranges[victim].bounds;
+        uint64_t r = atomic_load_explicit(bounds, memory_order_relaxed);
+        unsigned begin = (unsigned)r, end = (unsigned)(r >> 32);
+        /* Splitting off less than a grain costs more than it saves */
+        if (begin >= end || end - begin < 2 * rt_grain)
+            continue;
+        unsigned mid = begin + (end - begin) / 2;
+        if (atomic_compare_exchange_strong_explicit(bounds, &r, rt_pack(begin, mid),
+                                                    memory_order_acquire, memory_order_relaxed))
+        {
+            /* Nobody else touches an empty range */
+            atomic_store_explicit(&rt_ranges[self].bounds, rt_pack(mid, end),
+                                  memory_order_relaxed);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void rt_work(int self)
+{
+    while (atomic_load_explicit(&rt_job_remaining, memory_order_acquire) > 0)
+    {
+        if (!rt_run_own(self) && !rt_steal(self))
+            rt_cpu_relax();
+    }
+}
+
+static void *rt_worker_main(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    rt_in_parallel = 1;
+    unsigned seen = 0;
+    for (;;)
+    {
+        unsigned epoch = atomic_load_explicit(&rt_job_epoch, memory_order_acquire);
+        for (int spin = 0; epoch == seen && spin < RT_SPIN; spin++)
+        {
+            rt_cpu_relax();
+            epoch = atomic_load_explicit(&rt_job_epoch, memory_order_acquire);
+        }
+        if (epoch == seen)
+        {
+            pthread_mutex_lock(&rt_job_lock);
+            while ((epoch = atomic_load_explicit(&rt_job_epoch, memory_order_acquire)) == seen)
+                pthread_cond_wait(&rt_job_start, &rt_job_lock);
+            pthread_mutex_unlock(&rt_job_lock);
+        }
+        seen = epoch;
+
+        rt_work(self);
+        if (atomic_fetch_sub_explicit(&rt_job_busy, 1, memory_order_acq_rel) == 1)
+        {
+            pthread_mutex_lock(&rt_job_lock);
+            pthread_cond_signal(&rt_job_done);
+            pthread_mutex_unlock(&rt_job_lock);
+        }
+    }
+    return NULL;
+}
+
+/* Half of L1d per chunk leaves room for whatever else the body touches */
+static unsigned rt_grain_size(void)
+{
+    long bytes = 0;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    bytes = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+#endif
+    if (bytes <= 0)
+        bytes = 32 << 10;
+    return (unsigned)(bytes / 2 / sizeof(int));
+}
+
+/* Starts one worker per core but the caller's, or RT_THREADS - 1 */
+static void rt_pool_start(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *env = getenv("RT_THREADS");
+    if (env && *env)
+        count = atol(env);
+    if (count < 1)
+        count = 1;
+    if (count > RT_MAX_THREADS)
+        count = RT_MAX_THREADS;
+    rt_grain = rt_grain_size();
+
+    /* Signals are left to the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rt_threads = 1;
+    for (long i = 1; i < count; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, rt_worker_main, (void *)(intptr_t)i) != 0)
+            break;
+        pthread_detach(thread);
+        rt_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Number of threads a loop started here may run on: 1 inside a parallel
+   body, where loops run on the thread that reached them. */
+int rt_parallel_threads(void)
+{
+    if (rt_in_parallel)
+        return 1;
+    pthread_once(&rt_pool_once, rt_pool_start);
+    return rt_threads;
+}
+
+/* Calls body(env, begin, end, thread) over disjoint ranges covering
+   0..length and returns once all of them have finished. */
+void rt_parallel_for(rt_body_fn body, void *env, int length)
+{
+    if (length <= 0)
+        return;
+    if (rt_in_parallel)
+    {
+        body(env, 0, length, 0);
+        return;
+    }
+    pthread_once(&rt_pool_once, rt_pool_start);
+    if (rt_threads == 1 || (unsigned)length < 2 * rt_grain)
+    {
+        body(env, 0, length, 0);
+        return;
+    }
+
+    /* Start from equal shares; stealing evens out the rest */
+    unsigned share = (unsigned)length / rt_threads;
+    for (int i = 0; i < rt_threads; i++)
+    {
+        unsigned begin = share * i;
+        unsigned end = i == rt_threads - 1 ? (unsigned)length : begin + share;
+        atomic_store_explicit(&rt_ranges[i].bounds, rt_pack(begin, end), memory_order_relaxed);
+    }
+    rt_job_fn = body;
+    rt_job_env = env;
+    atomic_store_explicit(&rt_job_remaining, length, memory_order_relaxed);
+    atomic_store_explicit(&rt_job_busy, rt_threads - 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&rt_job_lock);
+    atomic_fetch_add_explicit(&rt_job_epoch, 1, memory_order_release);
+    pthread_cond_broadcast(&rt_job_start);
+    pthread_mutex_unlock(&rt_job_lock);
+
+    rt_in_parallel = 1;
+    rt_work(0);
+    rt_in_parallel = 0;
+
+    /* Workers still read the job until they check out */
+    for (int spin = 0; atomic_load_explicit(&rt_job_busy, memory_order_acquire) > 0 &&
+                       spin < RT_SPIN;
+         spin++)
+        rt_cpu_relax();
+    pthread_mutex_lock(&rt_job_lock);
+    while (atomic_load_explicit(&rt_job_busy, memory_order_acquire) > 0)
+        pthread_cond_wait(&rt_job_done, &rt_job_lock);
+    pthread_mutex_unlock(&rt_job_lock);
+}
@@ -2,11 +2,10 @@ cd build
 cd src
 
 echo "Compiling input.txt..."
-./compiler "$(cat ../../input.txt)" > compiler.ll 2>&1
+./compiler "$(cat ../../input.txt)" > compiler.ll
 
 if [ $? -ne 0 ]; then
     echo "Compilation failed!"
-    cat compiler.ll
     exit 1
 fi
 
@@ -19,7 +18,7 @@ if [ $? -ne 0 ]; then
 fi
 
 echo "Linking..."
-clang -o compilerbin compiler.o ../../rtCompiler.c
+clang -o compilerbin compiler.o ../../rtCompiler.c ../../rtArray.c ../../rtParallel.c -lm -pthread
 
 if [ $? -ne 0 ]; then
     echo "Linking failed!"
@@ -24,11 +24,10 @@ echo ""
 # Run compiler
 echo "Compiling..."
 cd build/src
-./compiler "$INPUT_CODE" > compiler.ll 2>&1
+./compiler "$INPUT_CODE" > compiler.ll
 
 if [ $? -ne 0 ]; then
     echo "Compilation failed!"
-    cat compiler.ll
     exit 1
 fi
 
@@ -50,7 +49,7 @@ fi
 
 # Link with runtime
 echo "Linking..."
-clang -o compilerbin compiler.o ../../rtCompiler.c
+clang -o compilerbin compiler.o ../../rtCompiler.c ../../rtArray.c ../../rtParallel.c -lm -pthread
 
 if [ $? -ne 0 ]; then
     echo "Linking failed!"
@@ -3,6 +3,9 @@
 
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringRef.h"
+#include <algorithm>
+#include <cstdint>
+#include <string>
 
 // Forward declarations of classes used in the AST
 class AST;
@@ -16,6 +19,7 @@ class Assignment;
 class Logic;
 class Comparison;
 class LogicalExpr;
+class LogicConst;
 class IfStmt;
 class ForStmt;
 class ForeachStmt;
@@ -25,6 +29,7 @@ class PrintStmt;
 class FunctionCall;
 class ArrayLiteral;
 class ArrayAccess;
+class ArraySlice;
 class SpecialAssignment;
 
 // Data type enumeration
@@ -52,6 +57,7 @@ public:
   virtual void visit(Logic &) {}
   virtual void visit(Comparison &) = 0;
   virtual void visit(LogicalExpr &) = 0;
+  virtual void visit(LogicConst &) = 0;
   virtual void visit(IfStmt &) = 0;
   virtual void visit(ForStmt &) = 0;
   virtual void visit(ForeachStmt &) = 0;
@@ -61,6 +67,7 @@ public:
   virtual void visit(FunctionCall &) = 0;
   virtual void visit(ArrayLiteral &) = 0;
   virtual void visit(ArrayAccess &) = 0;
+  virtual void visit(ArraySlice &) = 0;
   virtual void visit(SpecialAssignment &) = 0;
 };
 
@@ -75,8 +82,13 @@ public:
 // Expr class represents an expression in the AST
 class Expr : public AST
 {
+  DataType Ty; // Filled in by Sema
+
 public:
-  Expr() {}
+  Expr() : Ty(DataType::Unknown) {}
+
+  DataType getType() { return Ty; }
+  void setType(DataType T) { Ty = T; }
 };
 
 class Logic : public AST
@@ -98,6 +110,7 @@ public:
   Program() = default;
 
   llvm::SmallVector<AST *> getdata() { return data; }
+  void setdata(llvm::SmallVector<AST *> d) { data = d; }
 
   dataVector::const_iterator begin() { return data.begin(); }
 
@@ -117,11 +130,12 @@ class Declaration : public Program
   VarVector Vars;
   ValueVector Values;
   DataType Type;
+  bool DefaultObserved; // Whether the zero default of a variable may be read
 
 public:
   // Constructor for single variable declaration
   Declaration(llvm::StringRef Var, DataType Type, Expr *Value)
-    : Type(Type) {
+    : Type(Type), DefaultObserved(true) {
     Vars.push_back(Var);
     if (Value)
       Values.push_back(Value);
@@ -129,10 +143,13 @@ public:
 
   // Constructor for multiple variable declarations
   Declaration(DataType Type, llvm::SmallVector<llvm::StringRef, 8> Vars, llvm::SmallVector<Expr *, 8> Values)
-    : Type(Type), Vars(Vars), Values(Values) {}
+    : Type(Type), Vars(Vars), Values(Values), DefaultObserved(true) {}
 
   DataType getType() { return Type; }
 
+  bool isDefaultObserved() { return DefaultObserved; }
+  void setDefaultObserved(bool O) { DefaultObserved = O; }
+
   VarVector::const_iterator varBegin() { return Vars.begin(); }
 
   VarVector::const_iterator varEnd() { return Vars.end(); }
@@ -141,6 +158,8 @@ public:
 
   ValueVector::const_iterator valEnd() { return Values.end(); }
 
+  void setValue(unsigned I, Expr *E) { Values[I] = E; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -161,10 +180,10 @@ public:
 
 private:
   ValueKind Kind;
-  llvm::StringRef Val;
+  std::string Val; // Owned, so folded constants can be created after parsing
 
 public:
-  Final(ValueKind Kind, llvm::StringRef Val) : Kind(Kind), Val(Val) {}
+  Final(ValueKind Kind, llvm::StringRef Val) : Kind(Kind), Val(Val.str()) {}
 
   ValueKind getKind() { return Kind; }
 
@@ -202,6 +221,9 @@ public:
 
   Expr *getRight() { return Right; }
 
+  void setLeft(Expr *L) { Left = L; }
+  void setRight(Expr *R) { Right = R; }
+
   Operator getOperator() { return Op; }
 
   virtual void accept(ASTVisitor &V) override
@@ -256,14 +278,20 @@ private:
   Final *Left;
   Expr *Right;
   AssignKind AK;
+  ArrayAccess *Element; // Set for stores into an element of array Left
 
 public:
-  Assignment(Final *L, Expr *R, AssignKind AK) : Left(L), Right(R), AK(AK) {}
+  Assignment(Final *L, Expr *R, AssignKind AK, ArrayAccess *Element = nullptr)
+    : Left(L), Right(R), AK(AK), Element(Element) {}
 
   Final *getLeft() { return Left; }
 
+  ArrayAccess *getElement() { return Element; }
+
   Expr *getRight() { return Right; }
 
+  void setRight(Expr *R) { Right = R; }
+
   AssignKind getAssignKind() { return AK; }
 
   virtual void accept(ASTVisitor &V) override
@@ -338,6 +366,9 @@ public:
 
   Expr *getRight() { return Right; }
 
+  void setLeft(Expr *L) { Left = L; }
+  void setRight(Expr *R) { Right = R; }
+
   Operator getOperator() { return Op; }
 
   virtual void accept(ASTVisitor &V) override
@@ -368,6 +399,9 @@ public:
 
   Logic *getRight() { return Right; }
 
+  void setLeft(Logic *L) { Left = L; }
+  void setRight(Logic *R) { Right = R; }
+
   Operator getOperator() { return Op; }
 
   virtual void accept(ASTVisitor &V) override
@@ -376,6 +410,23 @@ public:
   }
 };
 
+// LogicConst is a condition whose value is known at compile time.
+// It is never parsed; the optimizer creates it when folding.
+class LogicConst : public Logic
+{
+  bool Value;
+
+public:
+  LogicConst(bool Value) : Value(Value) {}
+
+  bool getValue() { return Value; }
+
+  virtual void accept(ASTVisitor &V) override
+  {
+    V.visit(*this);
+  }
+};
+
 // IfStmt class represents if-else statements
 class IfStmt : public Program
 {
@@ -391,6 +442,7 @@ public:
     : Cond(Cond), ifStmts(ifStmts), elseStmts(elseStmts) {}
 
   Logic *getCond() { return Cond; }
+  void setCond(Logic *C) { Cond = C; }
 
   StmtVector::const_iterator begin() { return ifStmts.begin(); }
   StmtVector::const_iterator end() { return ifStmts.end(); }
@@ -398,34 +450,101 @@ public:
   StmtVector::const_iterator beginElse() { return elseStmts.begin(); }
   StmtVector::const_iterator endElse() { return elseStmts.end(); }
 
+  void setStmts(llvm::SmallVector<AST *, 8> S) { ifStmts = S; }
+  void setElseStmts(llvm::SmallVector<AST *, 8> S) { elseStmts = S; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
   }
 };
 
+// HoistedCheck is a bounds check moved in front of a loop: once the loop
+// is entered, Limit + Offset must not exceed the length of Array.
+struct HoistedCheck
+{
+  llvm::StringRef Array;
+  Expr *Limit;
+  int64_t Offset;
+};
+
+// Reduction is a variable the iterations of a parallel loop only combine
+// into with Op, so per-thread partial results can be merged in any order.
+struct Reduction
+{
+  enum OpKind
+  {
+    Add,
+    Mul,
+    Max
+  };
+
+  llvm::StringRef Var;
+  OpKind Op;
+};
+
 // ForStmt class represents for loops
 class ForStmt : public Program
 {
   using StmtVector = llvm::SmallVector<AST *, 8>;
+  using CheckVector = llvm::SmallVector<HoistedCheck, 2>;
+  using ReductionVector = llvm::SmallVector<Reduction, 4>;
   StmtVector body;
+  CheckVector Hoisted;
+  ReductionVector Reductions;
 
 private:
   Declaration *Init;
   Logic *Cond;
   AST *Increment;
+  bool Counted;      // Steps an induction variable towards a fixed bound
+  int64_t TripCount; // Iterations of a counted loop, -1 if not constant
+  bool ReleasesArrays; // No array allocated by the body outlives its iteration
+  bool Parallel;       // Iterations only share Reductions; run them on all cores
 
 public:
   ForStmt(Declaration *Init, Logic *Cond, AST *Increment, llvm::SmallVector<AST *, 8> body)
-    : Init(Init), Cond(Cond), Increment(Increment), body(body) {}
+    : Init(Init), Cond(Cond), Increment(Increment), body(body), Counted(false),
+      TripCount(-1), ReleasesArrays(false), Parallel(false) {}
+
+  bool releasesArrays() { return ReleasesArrays; }
+  void setReleasesArrays(bool R) { ReleasesArrays = R; }
+
+  bool isCounted() { return Counted; }
+  int64_t getTripCount() { return TripCount; }
+  void setCounted(int64_t Trips) { Counted = true; TripCount = Trips; }
+
+  bool isParallel() { return Parallel; }
+  void setParallel(ReductionVector R) { Parallel = true; Reductions = R; }
+  ReductionVector::const_iterator reductionsBegin() { return Reductions.begin(); }
+  ReductionVector::const_iterator reductionsEnd() { return Reductions.end(); }
 
   Declaration *getInit() { return Init; }
   Logic *getCond() { return Cond; }
   AST *getIncrement() { return Increment; }
 
+  void setCond(Logic *C) { Cond = C; }
+
+  // Keeps the strongest check per array and limit
+  void addHoistedCheck(HoistedCheck C)
+  {
+    for (HoistedCheck &H : Hoisted)
+      if (H.Array == C.Array && H.Limit == C.Limit)
+      {
+        H.Offset = std::max(H.Offset, C.Offset);
+        return;
+      }
+    Hoisted.push_back(C);
+  }
+
+  CheckVector::const_iterator checksBegin() { return Hoisted.begin(); }
+  CheckVector::const_iterator checksEnd() { return Hoisted.end(); }
+
   StmtVector::const_iterator begin() { return body.begin(); }
   StmtVector::const_iterator end() { return body.end(); }
 
+  void setBody(llvm::SmallVector<AST *, 8> B) { body = B; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -440,18 +559,34 @@ class ForeachStmt : public Program
 
 private:
   llvm::StringRef Var;
-  llvm::StringRef Array;
+  Expr *Array;         // The array or slice iterated over
+  bool ReleasesArrays; // No array allocated by the body outlives its iteration
+  bool Parallel;       // Iterations may run concurrently
+  llvm::SmallVector<llvm::StringRef, 4> Reductions; // Sums shared by a parallel loop
 
 public:
-  ForeachStmt(llvm::StringRef Var, llvm::StringRef Array, llvm::SmallVector<AST *, 8> body)
-    : Var(Var), Array(Array), body(body) {}
+  ForeachStmt(llvm::StringRef Var, Expr *Array, llvm::SmallVector<AST *, 8> body,
+              bool Parallel = false,
+              llvm::SmallVector<llvm::StringRef, 4> Reductions = {})
+    : Var(Var), Array(Array), body(body), ReleasesArrays(false), Parallel(Parallel),
+      Reductions(Reductions) {}
+
+  bool releasesArrays() { return ReleasesArrays; }
+  void setReleasesArrays(bool R) { ReleasesArrays = R; }
 
   llvm::StringRef getVar() { return Var; }
-  llvm::StringRef getArray() { return Array; }
+  Expr *getArray() { return Array; }
+  void setArray(Expr *E) { Array = E; }
+
+  bool isParallel() { return Parallel; }
+  llvm::SmallVector<llvm::StringRef, 4>::const_iterator reductionsBegin() { return Reductions.begin(); }
+  llvm::SmallVector<llvm::StringRef, 4>::const_iterator reductionsEnd() { return Reductions.end(); }
 
   StmtVector::const_iterator begin() { return body.begin(); }
   StmtVector::const_iterator end() { return body.end(); }
 
+  void setBody(llvm::SmallVector<AST *, 8> B) { body = B; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -459,24 +594,39 @@ public:
 };
 
 // MatchCase represents a single case in match statement
+// One alternative of a match arm: the value Lo, or the inclusive range
+// Lo..Hi when Hi is set.
+struct MatchPattern
+{
+  Expr *Lo;
+  Expr *Hi;
+
+  bool isRange() const { return Hi != nullptr; }
+};
+
 class MatchCase : public AST
 {
   using StmtVector = llvm::SmallVector<AST *, 8>;
+  using PatternVector = llvm::SmallVector<MatchPattern, 2>;
   StmtVector body;
 
 private:
-  Expr *Pattern; // null for default case (_)
+  PatternVector Patterns; // empty for default case (_)
 
 public:
-  MatchCase(Expr *Pattern, llvm::SmallVector<AST *, 8> body)
-    : Pattern(Pattern), body(body) {}
+  MatchCase(llvm::SmallVector<MatchPattern, 2> Patterns, llvm::SmallVector<AST *, 8> body)
+    : Patterns(Patterns), body(body) {}
 
-  Expr *getPattern() { return Pattern; }
-  bool isDefault() { return Pattern == nullptr; }
+  PatternVector::const_iterator patBegin() { return Patterns.begin(); }
+  PatternVector::const_iterator patEnd() { return Patterns.end(); }
+  void setPattern(unsigned I, MatchPattern P) { Patterns[I] = P; }
+  bool isDefault() { return Patterns.empty(); }
 
   StmtVector::const_iterator begin() { return body.begin(); }
   StmtVector::const_iterator end() { return body.end(); }
 
+  void setBody(llvm::SmallVector<AST *, 8> B) { body = B; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -497,10 +647,13 @@ public:
     : Value(Value), cases(cases) {}
 
   Expr *getValue() { return Value; }
+  void setValue(Expr *E) { Value = E; }
 
   CaseVector::const_iterator begin() { return cases.begin(); }
   CaseVector::const_iterator end() { return cases.end(); }
 
+  void setCases(llvm::SmallVector<MatchCase *, 8> C) { cases = C; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -517,6 +670,7 @@ public:
   PrintStmt(Expr *Value) : Value(Value) {}
 
   Expr *getValue() { return Value; }
+  void setValue(Expr *E) { Value = E; }
 
   virtual void accept(ASTVisitor &V) override
   {
@@ -537,7 +691,10 @@ public:
     Length,
     Max,
     Index,
-    Find
+    Find,
+    Read,
+    ReadFloat,
+    ReadArray
   };
 
 private:
@@ -553,6 +710,8 @@ public:
   llvm::SmallVector<Expr *, 4>::const_iterator argsBegin() { return Args.begin(); }
   llvm::SmallVector<Expr *, 4>::const_iterator argsEnd() { return Args.end(); }
 
+  void setArg(unsigned I, Expr *E) { Args[I] = E; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -564,13 +723,25 @@ class ArrayLiteral : public Expr
 {
 private:
   llvm::SmallVector<Expr *, 8> Elements;
+  bool ReadOnly; // No element store can reach the buffer
+  bool OnStack;  // Each value is dead before the literal is evaluated again
 
 public:
-  ArrayLiteral(llvm::SmallVector<Expr *, 8> Elements) : Elements(Elements) {}
+  ArrayLiteral(llvm::SmallVector<Expr *, 8> Elements)
+    : Elements(Elements), ReadOnly(false), OnStack(false) {}
+
+  bool isReadOnly() { return ReadOnly; }
+  void setReadOnly(bool R) { ReadOnly = R; }
+
+  bool isOnStack() { return OnStack; }
+  void setOnStack(bool S) { OnStack = S; }
 
   llvm::SmallVector<Expr *, 8>::const_iterator begin() { return Elements.begin(); }
   llvm::SmallVector<Expr *, 8>::const_iterator end() { return Elements.end(); }
 
+  unsigned size() { return Elements.size(); }
+  void setElement(unsigned I, Expr *E) { Elements[I] = E; }
+
   virtual void accept(ASTVisitor &V) override
   {
     V.visit(*this);
@@ -580,16 +751,29 @@ public:
 // ArrayAccess represents array indexing like arr[5]
 class ArrayAccess : public Expr
 {
+public:
+  enum CheckKind
+  {
+    Checked,   // Bounds are checked at the access
+    Hoisted,   // Checked once in front of the enclosing loop
+    Unchecked  // Proven in range
+  };
+
 private:
   llvm::StringRef ArrayName;
   Expr *Index;
+  CheckKind Check;
 
 public:
   ArrayAccess(llvm::StringRef ArrayName, Expr *Index)
-    : ArrayName(ArrayName), Index(Index) {}
+    : ArrayName(ArrayName), Index(Index), Check(Checked) {}
 
   llvm::StringRef getArrayName() { return ArrayName; }
   Expr *getIndex() { return Index; }
+  void setIndex(Expr *E) { Index = E; }
+
+  CheckKind getCheck() { return Check; }
+  void setCheck(CheckKind C) { Check = C; }
 
   virtual void accept(ASTVisitor &V) override
   {
@@ -597,4 +781,71 @@ public:
   }
 };
 
+// ArraySlice is the view ArrayName[Lo:Hi] of the elements Lo..Hi-1. It
+// shares the parent's storage; a missing Lo is 0 and a missing Hi the
+// parent's length.
+class ArraySlice : public Expr
+{
+  llvm::StringRef ArrayName;
+  Expr *Lo;
+  Expr *Hi;
+
+public:
+  ArraySlice(llvm::StringRef ArrayName, Expr *Lo, Expr *Hi)
+    : ArrayName(ArrayName), Lo(Lo), Hi(Hi) {}
+
+  llvm::StringRef getArrayName() { return ArrayName; }
+  Expr *getLo() { return Lo; }
+  Expr *getHi() { return Hi; }
+  void setLo(Expr *E) { Lo = E; }
+  void setHi(Expr *E) { Hi = E; }
+
+  virtual void accept(ASTVisitor &V) override
+  {
+    V.visit(*this);
+  }
+};
+
+// ASTMatcher records the visited node if its exact type is T.
+template <typename T>
+class ASTMatcher : public ASTVisitor
+{
+  void match(T &N) { Result = &N; }
+  template <typename U> void match(U &) {}
+
+public:
+  T *Result = nullptr;
+
+  virtual void visit(Final &N) override { match(N); }
+  virtual void visit(BinaryOp &N) override { match(N); }
+  virtual void visit(UnaryOp &N) override { match(N); }
+  virtual void visit(Assignment &N) override { match(N); }
+  virtual void visit(Declaration &N) override { match(N); }
+  virtual void visit(Comparison &N) override { match(N); }
+  virtual void visit(LogicalExpr &N) override { match(N); }
+  virtual void visit(LogicConst &N) override { match(N); }
+  virtual void visit(IfStmt &N) override { match(N); }
+  virtual void visit(ForStmt &N) override { match(N); }
+  virtual void visit(ForeachStmt &N) override { match(N); }
+  virtual void visit(MatchStmt &N) override { match(N); }
+  virtual void visit(MatchCase &N) override { match(N); }
+  virtual void visit(PrintStmt &N) override { match(N); }
+  virtual void visit(FunctionCall &N) override { match(N); }
+  virtual void visit(ArrayLiteral &N) override { match(N); }
+  virtual void visit(ArrayAccess &N) override { match(N); }
+  virtual void visit(ArraySlice &N) override { match(N); }
+  virtual void visit(SpecialAssignment &N) override { match(N); }
+};
+
+// dynCast returns Node as a T when that is its exact node type, or null.
+// The build disables RTTI, so the type is recovered through accept().
+template <typename T>
+T *dynCast(AST *Node)
+{
+  ASTMatcher<T> M;
+  if (Node)
+    Node->accept(M);
+  return M.Result;
+}
+
 #endif
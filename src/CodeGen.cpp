@@ -1,8 +1,12 @@
 #include "CodeGen.h"
+#include "Sema.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 
 using namespace llvm;
 
@@ -11,25 +15,441 @@ namespace {
     Module *M;
     IRBuilder<> Builder;
     Type *VoidTy;
+    Type *Int1Ty;
     Type *Int32Ty;
+    Type *Int64Ty;
+    Type *DoubleTy;
     Type *Int8PtrTy;
+    Type *Int32PtrTy;
+    // Arrays are a {data, length} pair over a contiguous i32 buffer
+    StructType *ArrayTy;
     Constant *Int32Zero;
+    bool BoundsChecks;
+    bool AsyncOutput;
+    // Set while emitting the copy of a loop that checks its hoisted accesses
+    bool CheckHoisted;
 
     Value *V;
-    StringMap<Value *> nameMap;
+    StringMap<AllocaInst *> nameMap;
+    // Slots of variables declared inside a block whose lifetime is still
+    // open, innermost block last.
+    SmallVector<AllocaInst *, 16> ScopedSlots;
+    unsigned BlockDepth = 0;
 
-    Function *PrintfFn;
+    FunctionCallee PrintI32Fn;
+    FunctionCallee PrintF64Fn;
+    FunctionCallee AllocFn;
+    FunctionCallee RegionMarkFn;
+    FunctionCallee RegionReleaseFn;
+    FunctionCallee BoundsFailFn;
+    FunctionCallee LengthFailFn;
+    FunctionCallee SliceFailFn;
+    FunctionCallee FindFn;
+    FunctionCallee MaxFn;
+    FunctionCallee ReadI32Fn;
+    FunctionCallee ReadF64Fn;
+    FunctionCallee ReadArrayFn;
+    FunctionCallee ParallelForFn;
+    FunctionCallee ParallelThreadsFn;
 
   public:
-    ToIRVisitor(Module *M) : M(M), Builder(M->getContext()) {
+    ToIRVisitor(Module *M, bool BoundsChecks, bool AsyncOutput)
+        : M(M), Builder(M->getContext()), BoundsChecks(BoundsChecks),
+          AsyncOutput(AsyncOutput), CheckHoisted(false) {
       VoidTy = Type::getVoidTy(M->getContext());
+      Int1Ty = Type::getInt1Ty(M->getContext());
       Int32Ty = Type::getInt32Ty(M->getContext());
+      Int64Ty = Type::getInt64Ty(M->getContext());
+      DoubleTy = Type::getDoubleTy(M->getContext());
       Int8PtrTy = Type::getInt8PtrTy(M->getContext());
+      Int32PtrTy = Type::getInt32PtrTy(M->getContext());
+      ArrayTy = StructType::create(M->getContext(), {Int32PtrTy, Int32Ty}, "array");
       Int32Zero = ConstantInt::get(Int32Ty, 0, true);
 
-      // Declare printf
-      FunctionType *PrintfTy = FunctionType::get(Int32Ty, {Int8PtrTy}, true);
-      PrintfFn = Function::Create(PrintfTy, GlobalValue::ExternalLinkage, "printf", M);
+      // Array buffers come from the bump allocator in rtArray.c
+      AllocFn = M->getOrInsertFunction("rt_alloc", Int8PtrTy, Int64Ty);
+      cast<Function>(AllocFn.getCallee())->addRetAttr(Attribute::NoAlias);
+      RegionMarkFn = M->getOrInsertFunction("rt_region_mark", Int8PtrTy);
+      RegionReleaseFn = M->getOrInsertFunction("rt_region_release", VoidTy, Int8PtrTy);
+      BoundsFailFn = M->getOrInsertFunction("rt_bounds_fail", VoidTy, Int32Ty, Int32Ty);
+      cast<Function>(BoundsFailFn.getCallee())->setDoesNotReturn();
+      LengthFailFn = M->getOrInsertFunction("rt_length_fail", VoidTy, Int32Ty, Int32Ty);
+      cast<Function>(LengthFailFn.getCallee())->setDoesNotReturn();
+      SliceFailFn = M->getOrInsertFunction("rt_slice_fail", VoidTy, Int32Ty, Int32Ty, Int32Ty);
+      cast<Function>(SliceFailFn.getCallee())->setDoesNotReturn();
+      FindFn = declareArrayKernel("rt_find_i32", {Int32PtrTy, Int32Ty, Int32Ty});
+      MaxFn = declareArrayKernel("rt_max_i32", {Int32PtrTy, Int32Ty});
+
+      ReadI32Fn = M->getOrInsertFunction("rt_read_i32", Int32Ty);
+      ReadF64Fn = M->getOrInsertFunction("rt_read_f64", DoubleTy);
+      ReadArrayFn = M->getOrInsertFunction("rt_read_array_i32", VoidTy, Int32PtrTy, Int32Ty);
+
+      // Runs body(env, begin, end, thread) over subranges of 0..length on
+      // all cores; thread is below rt_parallel_threads()
+      ParallelForFn = M->getOrInsertFunction("rt_parallel_for", VoidTy, Int8PtrTy, Int8PtrTy,
+                                             Int32Ty);
+      ParallelThreadsFn = M->getOrInsertFunction("rt_parallel_threads", Int32Ty);
+
+      // Buffered print entry points in rtCompiler.c, one per printed type
+      PrintI32Fn = M->getOrInsertFunction("rt_print_i32", VoidTy, Int32Ty);
+      PrintF64Fn = M->getOrInsertFunction("rt_print_f64", VoidTy, DoubleTy);
+      cast<Function>(PrintI32Fn.getCallee())->setDoesNotThrow();
+      cast<Function>(PrintF64Fn.getCallee())->setDoesNotThrow();
+    }
+
+    // The kernels in rtArray.c only read the buffer they are given, so LICM
+    // can hoist calls with invariant arguments out of loops.
+    FunctionCallee declareArrayKernel(StringRef Name, ArrayRef<Type *> Params) {
+      FunctionCallee Kernel =
+          M->getOrInsertFunction(Name, FunctionType::get(Int32Ty, Params, false));
+      Function *F = cast<Function>(Kernel.getCallee());
+      F->setOnlyReadsMemory();
+      F->setOnlyAccessesArgMemory();
+      F->setDoesNotThrow();
+      F->setWillReturn();
+      F->addParamAttr(0, Attribute::NoCapture);
+      return Kernel;
+    }
+
+    Type *mapType(DataType T) {
+      switch (T) {
+        case DataType::Float:
+          return DoubleTy;
+        case DataType::Bool:
+          return Int1Ty;
+        case DataType::Array:
+          return ArrayTy;
+        default:
+          return Int32Ty;
+      }
+    }
+
+    // Converts Val between the types Sema assigned; a no-op when they match.
+    Value *convert(Value *Val, DataType From, DataType To) {
+      if (From == To)
+        return Val;
+      switch (To) {
+        case DataType::Float:
+          return From == DataType::Bool ? Builder.CreateUIToFP(Val, DoubleTy)
+                                        : Builder.CreateSIToFP(Val, DoubleTy);
+        case DataType::Int:
+          return From == DataType::Float ? Builder.CreateFPToSI(Val, Int32Ty)
+                                         : Builder.CreateZExt(Val, Int32Ty);
+        case DataType::Bool:
+          return From == DataType::Float
+                     ? Builder.CreateFCmpUNE(Val, ConstantFP::get(DoubleTy, 0.0))
+                     : Builder.CreateICmpNE(Val, Int32Zero);
+        default:
+          return Val;
+      }
+    }
+
+    static DataType promote(DataType L, DataType R) {
+      return (L == DataType::Float || R == DataType::Float) ? DataType::Float
+                                                            : DataType::Int;
+    }
+
+    // Evaluates E and converts the result to type To.
+    Value *emitAs(Expr *E, DataType To) {
+      E->accept(*this);
+      return convert(V, E->getType(), To);
+    }
+
+    Value *emitArith(BinaryOp::Operator Op, Value *L, Value *R, DataType T) {
+      if (T == DataType::Float) {
+        switch (Op) {
+          case BinaryOp::Plus:
+            return Builder.CreateFAdd(L, R);
+          case BinaryOp::Minus:
+            return Builder.CreateFSub(L, R);
+          case BinaryOp::Mul:
+            return Builder.CreateFMul(L, R);
+          case BinaryOp::Div:
+            return Builder.CreateFDiv(L, R);
+          case BinaryOp::Mod:
+            return Builder.CreateFRem(L, R);
+          case BinaryOp::Exp:
+            return emitFloatPow(L, R);
+        }
+      }
+      switch (Op) {
+        case BinaryOp::Plus:
+          return Builder.CreateAdd(L, R);
+        case BinaryOp::Minus:
+          return Builder.CreateSub(L, R);
+        case BinaryOp::Mul:
+          return Builder.CreateMul(L, R);
+        case BinaryOp::Div:
+          return Builder.CreateSDiv(L, R);
+        case BinaryOp::Mod:
+          return Builder.CreateSRem(L, R);
+        case BinaryOp::Exp:
+          return emitIntPow(L, R);
+      }
+      return L;
+    }
+
+    // A whole-number exponent lets llvm.powi replace the libm call; with a
+    // constant one the backend expands it into multiplies.
+    Value *emitFloatPow(Value *Base, Value *Exponent) {
+      Value *IntExponent = nullptr;
+      if (auto *C = dyn_cast<ConstantFP>(Exponent)) {
+        APSInt Int(32, false);
+        bool IsExact;
+        if (C->getValueAPF().convertToInteger(Int, APFloat::rmTowardZero, &IsExact) ==
+            APFloat::opOK)
+          IntExponent = ConstantInt::get(Int32Ty, Int);
+      } else if (auto *Conv = dyn_cast<SIToFPInst>(Exponent)) {
+        if (Conv->getOperand(0)->getType() == Int32Ty)
+          IntExponent = Conv->getOperand(0);
+      }
+      if (!IntExponent)
+        return Builder.CreateBinaryIntrinsic(Intrinsic::pow, Base, Exponent);
+
+      Value *Result = Builder.CreateIntrinsic(Intrinsic::powi, {DoubleTy, Int32Ty},
+                                              {Base, IntExponent});
+      if (auto *Conv = dyn_cast<SIToFPInst>(Exponent))
+        if (Conv->use_empty())
+          Conv->eraseFromParent();
+      return Result;
+    }
+
+    // Base ^ Exponent for a negative exponent: 1 / Base^-Exponent truncated
+    // like /, so 1, -1 or 0, and a zero base divides by zero. 1 / Base is
+    // one of 1, -1 and 0, which an odd power keeps and an even one squares.
+    Value *emitNegativeIntPow(Value *Base, Value *Exponent) {
+      Value *Inverse = Builder.CreateSDiv(ConstantInt::get(Int32Ty, 1), Base);
+      return Builder.CreateSelect(Builder.CreateTrunc(Exponent, Int1Ty), Inverse,
+                                  Builder.CreateMul(Inverse, Inverse));
+    }
+
+    // Exponentiation by squaring. Constant exponents are unrolled into at
+    // most two multiplies per bit; otherwise the squaring runs as a loop.
+    // The result wraps like any int product.
+    Value *emitIntPow(Value *Base, Value *Exponent) {
+      if (auto *C = dyn_cast<ConstantInt>(Exponent)) {
+        if (C->isNegative())
+          return emitNegativeIntPow(Base, Exponent);
+        Value *Result = nullptr;
+        for (uint64_t N = C->getZExtValue(); N; N >>= 1) {
+          if (N & 1)
+            Result = Result ? Builder.CreateMul(Result, Base) : Base;
+          if (N > 1)
+            Base = Builder.CreateMul(Base, Base);
+        }
+        return Result ? Result : ConstantInt::get(Int32Ty, 1);
+      }
+
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+      BasicBlock *HeaderBB = BasicBlock::Create(M->getContext(), "pow.header", TheFunction);
+      BasicBlock *BodyBB = BasicBlock::Create(M->getContext(), "pow.body", TheFunction);
+      BasicBlock *ExitBB = BasicBlock::Create(M->getContext(), "pow.exit", TheFunction);
+      Builder.CreateBr(HeaderBB);
+
+      Builder.SetInsertPoint(HeaderBB);
+      PHINode *Result = Builder.CreatePHI(Int32Ty, 2, "pow.result");
+      PHINode *Square = Builder.CreatePHI(Int32Ty, 2, "pow.base");
+      PHINode *Bits = Builder.CreatePHI(Int32Ty, 2, "pow.bits");
+      Result->addIncoming(ConstantInt::get(Int32Ty, 1), PreheaderBB);
+      Square->addIncoming(Base, PreheaderBB);
+      Bits->addIncoming(Exponent, PreheaderBB);
+      Builder.CreateCondBr(Builder.CreateICmpSGT(Bits, ConstantInt::get(Int32Ty, 0)),
+                           BodyBB, ExitBB);
+
+      Builder.SetInsertPoint(BodyBB);
+      Value *Odd = Builder.CreateTrunc(Bits, Int1Ty);
+      Value *Product = Builder.CreateSelect(Odd, Builder.CreateMul(Result, Square), Result);
+      Result->addIncoming(Product, BodyBB);
+      Square->addIncoming(Builder.CreateMul(Square, Square), BodyBB);
+      Bits->addIncoming(Builder.CreateLShr(Bits, 1), BodyBB);
+      Builder.CreateBr(HeaderBB);
+
+      Builder.SetInsertPoint(ExitBB);
+      // A negative exponent leaves the loop at once with Result = 1. Base is
+      // only divided when the exponent is negative, so 0 ^ 2 does not trap
+      Value *Negative = Builder.CreateICmpSLT(Exponent, ConstantInt::get(Int32Ty, 0));
+      Value *Divisor = Builder.CreateSelect(Negative, Base, ConstantInt::get(Int32Ty, 1));
+      return Builder.CreateSelect(Negative, emitNegativeIntPow(Divisor, Exponent), Result);
+    }
+
+    DataType typeOfSlot(AllocaInst *Slot) {
+      Type *T = Slot->getAllocatedType();
+      if (T == DoubleTy)
+        return DataType::Float;
+      if (T == Int1Ty)
+        return DataType::Bool;
+      return DataType::Int;
+    }
+
+    // Every slot lives in the entry block, so loops do not grow the stack
+    // and mem2reg can promote all of them.
+    AllocaInst *createSlot(Type *Ty, StringRef Name) {
+      BasicBlock &Entry = Builder.GetInsertBlock()->getParent()->getEntryBlock();
+      IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+      return EntryBuilder.CreateAlloca(Ty, nullptr, Name);
+    }
+
+    size_t enterBlock() {
+      ++BlockDepth;
+      return ScopedSlots.size();
+    }
+
+    void leaveBlock(size_t Mark) {
+      --BlockDepth;
+      while (ScopedSlots.size() > Mark)
+        Builder.CreateLifetimeEnd(ScopedSlots.pop_back_val());
+    }
+
+    void emitBlock(SmallVector<AST *, 8>::const_iterator I,
+                   SmallVector<AST *, 8>::const_iterator E) {
+      size_t Mark = enterBlock();
+      for (; I != E; ++I)
+        (*I)->accept(*this);
+      leaveBlock(Mark);
+    }
+
+    // Emits a loop body. When no array it allocates outlives the iteration,
+    // the allocator is reset to where it stood when the iteration began.
+    void emitLoopBody(bool ReleasesArrays, SmallVector<AST *, 8>::const_iterator I,
+                      SmallVector<AST *, 8>::const_iterator E) {
+      Value *Mark = ReleasesArrays ? Builder.CreateCall(RegionMarkFn) : nullptr;
+      emitBlock(I, E);
+      if (Mark)
+        Builder.CreateCall(RegionReleaseFn, {Mark});
+    }
+
+    Value *makeArray(Value *Data, Value *Length) {
+      Value *Arr = Builder.CreateInsertValue(UndefValue::get(ArrayTy), Data, 0);
+      return Builder.CreateInsertValue(Arr, Length, 1);
+    }
+
+    // Stops the program unless 0 <= Index < Length; one unsigned compare
+    // covers both ends.
+    void emitBoundsCheck(Value *Index, Value *Length) {
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *FailBB = BasicBlock::Create(M->getContext(), "oob", TheFunction);
+      BasicBlock *OkBB = BasicBlock::Create(M->getContext(), "inbounds", TheFunction);
+      Value *InRange = Builder.CreateICmpULT(Index, Length);
+      Builder.CreateCondBr(InRange, OkBB, FailBB,
+                           MDBuilder(M->getContext()).createBranchWeights(1 << 20, 1));
+
+      Builder.SetInsertPoint(FailBB);
+      Builder.CreateCall(BoundsFailFn, {Index, Length});
+      Builder.CreateUnreachable();
+
+      Builder.SetInsertPoint(OkBB);
+    }
+
+    // Stops the program unless 0 <= Lo <= Hi <= Length.
+    void emitSliceCheck(Value *Lo, Value *Hi, Value *Length) {
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *FailBB = BasicBlock::Create(M->getContext(), "sliceoob", TheFunction);
+      BasicBlock *OkBB = BasicBlock::Create(M->getContext(), "sliceok", TheFunction);
+      Value *InRange = Builder.CreateAnd(Builder.CreateICmpULE(Hi, Length),
+                                         Builder.CreateICmpULE(Lo, Hi));
+      Builder.CreateCondBr(InRange, OkBB, FailBB,
+                           MDBuilder(M->getContext()).createBranchWeights(1 << 20, 1));
+
+      Builder.SetInsertPoint(FailBB);
+      Builder.CreateCall(SliceFailFn, {Lo, Hi, Length});
+      Builder.CreateUnreachable();
+
+      Builder.SetInsertPoint(OkBB);
+    }
+
+    // Evaluates the index of Node and returns the address of the element.
+    Value *emitElementPtr(ArrayAccess &Node) {
+      AllocaInst *Slot = nameMap[Node.getArrayName()];
+      Value *Arr = Builder.CreateLoad(ArrayTy, Slot);
+      Value *Index = emitAs(Node.getIndex(), DataType::Int);
+      if (BoundsChecks && (Node.getCheck() == ArrayAccess::Checked ||
+                           (CheckHoisted && Node.getCheck() == ArrayAccess::Hoisted)))
+        emitBoundsCheck(Index, Builder.CreateExtractValue(Arr, 1));
+      Value *Data = Builder.CreateExtractValue(Arr, 0);
+      return Builder.CreateInBoundsGEP(Int32Ty, Data, Index);
+    }
+
+    // Checks once, before the loop, the accesses the optimizer proved to
+    // stay below a loop-invariant limit. Nothing is checked if the loop
+    // does not run at all. If a check fails, control goes to the returned
+    // block, where the caller emits the loop again with every access
+    // checked: the iterations before the bad index still run, print and
+    // fail on the same index as without hoisting. Returns null if there is
+    // nothing to check.
+    BasicBlock *emitHoistedChecks(ForStmt &Node) {
+      if (!BoundsChecks || CheckHoisted || Node.checksBegin() == Node.checksEnd())
+        return nullptr;
+
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *CheckBB = BasicBlock::Create(M->getContext(), "loopcheck", TheFunction);
+      BasicBlock *DoneBB = BasicBlock::Create(M->getContext(), "loopchecked", TheFunction);
+      BasicBlock *CheckedBB = BasicBlock::Create(M->getContext(), "for.checked");
+      Node.getCond()->accept(*this);
+      Builder.CreateCondBr(V, CheckBB, DoneBB);
+
+      Builder.SetInsertPoint(CheckBB);
+      for (auto I = Node.checksBegin(), E = Node.checksEnd(); I != E; ++I) {
+        Value *Arr = Builder.CreateLoad(ArrayTy, nameMap[I->Array]);
+        Value *Limit = Builder.CreateSExt(emitAs(I->Limit, DataType::Int), Int64Ty);
+        // The largest index the loop uses is Limit + Offset - 1
+        Value *Last = Builder.CreateAdd(Limit, ConstantInt::get(Int64Ty, I->Offset - 1));
+        Value *Length = Builder.CreateExtractValue(Arr, 1);
+        Value *InRange = Builder.CreateICmpSLT(Last, Builder.CreateZExt(Length, Int64Ty));
+        BasicBlock *OkBB = BasicBlock::Create(M->getContext(), "inbounds", TheFunction);
+        Builder.CreateCondBr(InRange, OkBB, CheckedBB,
+                             MDBuilder(M->getContext()).createBranchWeights(1 << 20, 1));
+        Builder.SetInsertPoint(OkBB);
+      }
+      Builder.CreateBr(DoneBB);
+      Builder.SetInsertPoint(DoneBB);
+      return CheckedBB;
+    }
+
+    // Emits CheckedBB, from emitHoistedChecks, as the copy of the loop that
+    // checks every access, continuing at ExitBB.
+    void emitCheckedLoop(ForStmt &Node, BasicBlock *CheckedBB, BasicBlock *ExitBB) {
+      Builder.GetInsertBlock()->getParent()->getBasicBlockList().push_back(CheckedBB);
+      Builder.SetInsertPoint(CheckedBB);
+      CheckHoisted = true;
+      emitLoop(Node, ExitBB);
+      CheckHoisted = false;
+    }
+
+    MDNode *loopHint(StringRef Name, bool Value) {
+      LLVMContext &Ctx = M->getContext();
+      return MDNode::get(Ctx, {MDString::get(Ctx, Name),
+                               ConstantAsMetadata::get(ConstantInt::get(Int1Ty, Value))});
+    }
+
+    // Builds the distinct, self-referencing node !llvm.loop expects.
+    MDNode *makeLoopID(ArrayRef<Metadata *> Hints) {
+      SmallVector<Metadata *, 4> Ops;
+      Ops.push_back(nullptr);
+      Ops.append(Hints.begin(), Hints.end());
+      MDNode *ID = MDNode::getDistinct(M->getContext(), Ops);
+      ID->replaceOperandWith(0, ID);
+      return ID;
+    }
+
+    // Loops known to finish may be assumed to make progress, and those whose
+    // body only computes are worth vectorizing. Loops that print gain
+    // nothing from runtime unrolling but code size.
+    MDNode *loopMetadata(SmallVector<AST *, 8>::const_iterator I,
+                         SmallVector<AST *, 8>::const_iterator E, bool Finite) {
+      LLVMContext &Ctx = M->getContext();
+      bool SideEffects = false;
+      for (; I != E && !SideEffects; ++I)
+        SideEffects = Sema::useDef(*I).SideEffects;
+
+      SmallVector<Metadata *, 2> Hints;
+      if (Finite)
+        Hints.push_back(MDNode::get(Ctx, MDString::get(Ctx, "llvm.loop.mustprogress")));
+      if (SideEffects)
+        Hints.push_back(MDNode::get(Ctx, MDString::get(Ctx, "llvm.loop.unroll.runtime.disable")));
+      else if (Finite)
+        Hints.push_back(loopHint("llvm.loop.vectorize.enable", true));
+      return Hints.empty() ? nullptr : makeLoopID(Hints);
     }
 
     void run(Program *Tree) {
@@ -38,6 +458,10 @@ namespace {
       BasicBlock *BB = BasicBlock::Create(M->getContext(), "entry", MainFn);
       Builder.SetInsertPoint(BB);
 
+      // Starts the runtime's output thread before anything is printed
+      if (AsyncOutput)
+        Builder.CreateCall(M->getOrInsertFunction("rt_async_output", VoidTy));
+
       Tree->accept(*this);
 
       Builder.CreateRet(Int32Zero);
@@ -53,104 +477,143 @@ namespace {
       auto VarIt = Node.varBegin();
       auto ValIt = Node.valBegin();
 
+      Type *Ty = mapType(Node.getType());
+
       for (; VarIt != Node.varEnd(); ++VarIt) {
-        AllocaInst *Alloca = Builder.CreateAlloca(Int32Ty, nullptr, *VarIt);
+        AllocaInst *Alloca = createSlot(Ty, *VarIt);
         nameMap[*VarIt] = Alloca;
+        if (BlockDepth > 0) {
+          Builder.CreateLifetimeStart(Alloca);
+          ScopedSlots.push_back(Alloca);
+        }
 
         if (ValIt != Node.valEnd()) {
-          (*ValIt)->accept(*this);
-          Builder.CreateStore(V, Alloca);
+          Builder.CreateStore(emitAs(*ValIt, Node.getType()), Alloca);
           ++ValIt;
-        } else {
-          Builder.CreateStore(Int32Zero, Alloca);
+        } else if (Node.isDefaultObserved()) {
+          Builder.CreateStore(Constant::getNullValue(Ty), Alloca);
         }
       }
     }
 
     virtual void visit(Assignment &Node) override {
-      Node.getRight()->accept(*this);
-      Value *RightVal = V;
+      DataType DestTy;
+      Value *Var;
+      if (ArrayAccess *Element = Node.getElement()) {
+        DestTy = DataType::Int;
+        Var = emitElementPtr(*Element);
+      } else {
+        DestTy = Node.getLeft()->getType();
+        Var = nameMap[Node.getLeft()->getVal()];
+      }
+      Type *VarTy = mapType(DestTy);
 
-      StringRef VarName = Node.getLeft()->getVal();
-      Value *Var = nameMap[VarName];
+      if (Node.getAssignKind() == Assignment::Assign) {
+        Builder.CreateStore(emitAs(Node.getRight(), DestTy), Var);
+        return;
+      }
 
-      if (Node.getAssignKind() != Assignment::Assign) {
-        Value *OldVal = Builder.CreateLoad(Int32Ty, Var);
-        switch (Node.getAssignKind()) {
-          case Assignment::Plus_assign:
-            RightVal = Builder.CreateAdd(OldVal, RightVal);
-            break;
-          case Assignment::Minus_assign:
-            RightVal = Builder.CreateSub(OldVal, RightVal);
-            break;
-          case Assignment::Star_assign:
-            RightVal = Builder.CreateMul(OldVal, RightVal);
-            break;
-          case Assignment::Slash_assign:
-            RightVal = Builder.CreateSDiv(OldVal, RightVal);
-            break;
-          default:
-            break;
-        }
+      // Compound assignments compute in the wider of the two types
+      DataType OpTy = promote(DestTy, Node.getRight()->getType());
+      Value *RightVal = emitAs(Node.getRight(), OpTy);
+      Value *OldVal = convert(Builder.CreateLoad(VarTy, Var), DestTy, OpTy);
+
+      BinaryOp::Operator Op;
+      switch (Node.getAssignKind()) {
+        case Assignment::Plus_assign:
+          Op = BinaryOp::Plus;
+          break;
+        case Assignment::Minus_assign:
+          Op = BinaryOp::Minus;
+          break;
+        case Assignment::Star_assign:
+          Op = BinaryOp::Mul;
+          break;
+        case Assignment::Slash_assign:
+          Op = BinaryOp::Div;
+          break;
+        case Assignment::Mod_assign:
+          Op = BinaryOp::Mod;
+          break;
+        default:
+          Op = BinaryOp::Exp;
+          break;
       }
 
-      Builder.CreateStore(RightVal, Var);
+      Value *Result = emitArith(Op, OldVal, RightVal, OpTy);
+      Builder.CreateStore(convert(Result, OpTy, DestTy), Var);
     }
 
     virtual void visit(SpecialAssignment &Node) override {
-      Value *Dest = nameMap[Node.getDest()];
-
-      if (Node.getOpKind() == SpecialAssignment::INC) {
-        Value *OldVal = Builder.CreateLoad(Int32Ty, Dest);
-        Value *NewVal = Builder.CreateAdd(OldVal, ConstantInt::get(Int32Ty, 1));
-        Builder.CreateStore(NewVal, Dest);
-      }
-      else if (Node.getOpKind() == SpecialAssignment::DEC) {
-        Value *OldVal = Builder.CreateLoad(Int32Ty, Dest);
-        Value *NewVal = Builder.CreateSub(OldVal, ConstantInt::get(Int32Ty, 1));
-        Builder.CreateStore(NewVal, Dest);
-      }
-      else {
-        // For ADD, SUB, etc. - simplified implementation
-        Value *Arg1Val = Builder.CreateLoad(Int32Ty, nameMap[Node.getArg1()]);
-        Value *Arg2Val = !Node.getArg2().empty() ? Builder.CreateLoad(Int32Ty, nameMap[Node.getArg2()]) : nullptr;
-        Value *Result = nullptr;
+      AllocaInst *Dest = nameMap[Node.getDest()];
+      DataType DestTy = typeOfSlot(Dest);
 
-        switch (Node.getOpKind()) {
-          case SpecialAssignment::ADD:
-            Result = Builder.CreateAdd(Arg1Val, Arg2Val);
-            break;
-          case SpecialAssignment::SUB:
-            Result = Builder.CreateSub(Arg1Val, Arg2Val);
-            break;
-          case SpecialAssignment::MUL:
-            Result = Builder.CreateMul(Arg1Val, Arg2Val);
-            break;
-          case SpecialAssignment::DIV:
-            Result = Builder.CreateSDiv(Arg1Val, Arg2Val);
-            break;
-          case SpecialAssignment::PLE:
-            Result = Builder.CreateAdd(Builder.CreateLoad(Int32Ty, Dest), Arg1Val);
-            break;
-          case SpecialAssignment::MIE:
-            Result = Builder.CreateSub(Builder.CreateLoad(Int32Ty, Dest), Arg1Val);
-            break;
-          default:
-            Result = Arg1Val;
-            break;
-        }
+      if (Node.getOpKind() == SpecialAssignment::INC ||
+          Node.getOpKind() == SpecialAssignment::DEC) {
+        Value *OldVal = Builder.CreateLoad(Dest->getAllocatedType(), Dest);
+        Value *One = DestTy == DataType::Float ? ConstantFP::get(DoubleTy, 1.0)
+                                               : ConstantInt::get(Int32Ty, 1);
+        BinaryOp::Operator Op = Node.getOpKind() == SpecialAssignment::INC
+                                    ? BinaryOp::Plus
+                                    : BinaryOp::Minus;
+        Builder.CreateStore(emitArith(Op, OldVal, One, DestTy), Dest);
+        return;
+      }
 
-        if (Result)
-          Builder.CreateStore(Result, Dest);
+      // PLE and MIE use the destination as their left operand
+      bool Accumulate = Node.getOpKind() == SpecialAssignment::PLE ||
+                        Node.getOpKind() == SpecialAssignment::MIE;
+      AllocaInst *Arg1 = Accumulate ? Dest : nameMap[Node.getArg1()];
+      AllocaInst *Arg2 = Accumulate ? nameMap[Node.getArg1()] : nameMap[Node.getArg2()];
+      DataType Arg1Ty = typeOfSlot(Arg1);
+      DataType Arg2Ty = typeOfSlot(Arg2);
+      Value *Arg1Val = Builder.CreateLoad(Arg1->getAllocatedType(), Arg1);
+      Value *Arg2Val = Builder.CreateLoad(Arg2->getAllocatedType(), Arg2);
+
+      if (Node.getOpKind() == SpecialAssignment::AND) {
+        Builder.CreateStore(Builder.CreateAnd(Arg1Val, Arg2Val), Dest);
+        return;
+      }
+      if (Node.getOpKind() == SpecialAssignment::OR) {
+        Builder.CreateStore(Builder.CreateOr(Arg1Val, Arg2Val), Dest);
+        return;
+      }
+
+      BinaryOp::Operator Op;
+      switch (Node.getOpKind()) {
+        case SpecialAssignment::ADD:
+        case SpecialAssignment::PLE:
+          Op = BinaryOp::Plus;
+          break;
+        case SpecialAssignment::SUB:
+        case SpecialAssignment::MIE:
+          Op = BinaryOp::Minus;
+          break;
+        case SpecialAssignment::MUL:
+          Op = BinaryOp::Mul;
+          break;
+        case SpecialAssignment::DIV:
+          Op = BinaryOp::Div;
+          break;
+        default:
+          Op = BinaryOp::Mod;
+          break;
       }
+
+      DataType OpTy = promote(Arg1Ty, Arg2Ty);
+      Value *Result = emitArith(Op, convert(Arg1Val, Arg1Ty, OpTy),
+                                convert(Arg2Val, Arg2Ty, OpTy), OpTy);
+      Builder.CreateStore(convert(Result, OpTy, DestTy), Dest);
     }
 
     virtual void visit(Final &Node) override {
       if (Node.getKind() == Final::Ident) {
-        V = Builder.CreateLoad(Int32Ty, nameMap[Node.getVal()]);
+        AllocaInst *Slot = nameMap[Node.getVal()];
+        V = Builder.CreateLoad(Slot->getAllocatedType(), Slot);
       } else if (Node.getKind() == Final::Bool) {
-        int val = (Node.getVal() == "true") ? 1 : 0;
-        V = ConstantInt::get(Int32Ty, val);
+        V = ConstantInt::get(Int1Ty, Node.getVal() == "true");
+      } else if (Node.getKind() == Final::Float) {
+        V = ConstantFP::get(DoubleTy, Node.getVal());
       } else {
         int intval;
         Node.getVal().getAsInteger(10, intval);
@@ -159,42 +622,146 @@ namespace {
     }
 
     virtual void visit(BinaryOp &Node) override {
-      Node.getLeft()->accept(*this);
-      Value *Left = V;
-      Node.getRight()->accept(*this);
-      Value *Right = V;
+      if (Node.getType() == DataType::Array) {
+        emitElementwise(Node);
+        return;
+      }
+      DataType T = Node.getType();
+      Value *Left = emitAs(Node.getLeft(), T);
+      Value *Right = emitAs(Node.getRight(), T);
+      V = emitArith(Node.getOperator(), Left, Right, T);
+    }
 
-      switch (Node.getOperator()) {
-        case BinaryOp::Plus:
-          V = Builder.CreateAdd(Left, Right);
-          break;
-        case BinaryOp::Minus:
-          V = Builder.CreateSub(Left, Right);
-          break;
-        case BinaryOp::Mul:
-          V = Builder.CreateMul(Left, Right);
-          break;
-        case BinaryOp::Div:
-          V = Builder.CreateSDiv(Left, Right);
-          break;
-        case BinaryOp::Mod:
-          V = Builder.CreateSRem(Left, Right);
-          break;
-        default:
-          V = Left;
-          break;
+    // Operands of an element-wise expression other than its array-valued
+    // BinaryOps, evaluated once in order: array data pointers and int scalars.
+    void collectOperands(Expr *E, DenseMap<Expr *, Value *> &Operands, Value *&Length) {
+      BinaryOp *Op = dynCast<BinaryOp>(E);
+      if (Op && Op->getType() == DataType::Array) {
+        collectOperands(Op->getLeft(), Operands, Length);
+        collectOperands(Op->getRight(), Operands, Length);
+        return;
       }
+      E->accept(*this);
+      if (E->getType() != DataType::Array) {
+        Operands[E] = convert(V, E->getType(), DataType::Int);
+        return;
+      }
+      Operands[E] = Builder.CreateExtractValue(V, 0);
+      Value *Len = Builder.CreateExtractValue(V, 1);
+      if (!Length) {
+        Length = Len;
+        return;
+      }
+
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *FailBB = BasicBlock::Create(M->getContext(), "lenmismatch", TheFunction);
+      BasicBlock *OkBB = BasicBlock::Create(M->getContext(), "lenmatch", TheFunction);
+      Builder.CreateCondBr(Builder.CreateICmpEQ(Length, Len), OkBB, FailBB,
+                           MDBuilder(M->getContext()).createBranchWeights(1 << 20, 1));
+      Builder.SetInsertPoint(FailBB);
+      Builder.CreateCall(LengthFailFn, {Length, Len});
+      Builder.CreateUnreachable();
+      Builder.SetInsertPoint(OkBB);
+    }
+
+    // Element Index of E, with operands taken from collectOperands.
+    Value *emitElement(Expr *E, Value *Index, DenseMap<Expr *, Value *> &Operands) {
+      BinaryOp *Op = dynCast<BinaryOp>(E);
+      if (Op && Op->getType() == DataType::Array) {
+        Value *L = emitElement(Op->getLeft(), Index, Operands);
+        Value *R = emitElement(Op->getRight(), Index, Operands);
+        return emitArith(Op->getOperator(), L, R, DataType::Int);
+      }
+      Value *Operand = Operands[E];
+      if (E->getType() != DataType::Array)
+        return Operand;
+      return Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(Int32Ty, Operand, Index));
+    }
+
+    // A whole tree of element-wise operators becomes one loop that reads
+    // each operand array once and writes a single new array, so a + b * c
+    // never materializes b * c.
+    void emitElementwise(BinaryOp &Node) {
+      DenseMap<Expr *, Value *> Operands;
+      Value *Length = nullptr;
+      collectOperands(&Node, Operands, Length);
+
+      Value *Bytes = Builder.CreateMul(Builder.CreateZExt(Length, Int64Ty),
+                                       ConstantInt::get(Int64Ty, 4));
+      Value *Data = Builder.CreateBitCast(Builder.CreateCall(AllocFn, {Bytes}), Int32PtrTy);
+
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+      BasicBlock *HeaderBB = BasicBlock::Create(M->getContext(), "elementwise.header", TheFunction);
+      BasicBlock *BodyBB = BasicBlock::Create(M->getContext(), "elementwise.body", TheFunction);
+      BasicBlock *ExitBB = BasicBlock::Create(M->getContext(), "elementwise.exit");
+      Builder.CreateBr(HeaderBB);
+
+      Builder.SetInsertPoint(HeaderBB);
+      PHINode *Index = Builder.CreatePHI(Int32Ty, 2, "idx");
+      Index->addIncoming(Int32Zero, PreheaderBB);
+      Builder.CreateCondBr(Builder.CreateICmpSLT(Index, Length), BodyBB, ExitBB);
+
+      Builder.SetInsertPoint(BodyBB);
+      Builder.CreateStore(emitElement(&Node, Index, Operands),
+                          Builder.CreateInBoundsGEP(Int32Ty, Data, Index));
+      Value *Next = Builder.CreateAdd(Index, ConstantInt::get(Int32Ty, 1), "idx.next",
+                                      /*HasNUW=*/true, /*HasNSW=*/true);
+      Index->addIncoming(Next, Builder.GetInsertBlock());
+      LLVMContext &Ctx = M->getContext();
+      Builder.CreateBr(HeaderBB)->setMetadata(
+          LLVMContext::MD_loop,
+          makeLoopID({MDNode::get(Ctx, MDString::get(Ctx, "llvm.loop.mustprogress")),
+                      loopHint("llvm.loop.vectorize.enable", true)}));
+
+      TheFunction->getBasicBlockList().push_back(ExitBB);
+      Builder.SetInsertPoint(ExitBB);
+      V = makeArray(Data, Length);
     }
 
     virtual void visit(UnaryOp &Node) override {
-      Node.getOperand()->accept(*this);
+      // The parser only builds ++/-- around identifiers
+      AllocaInst *Slot = nameMap[static_cast<Final *>(Node.getOperand())->getVal()];
+      DataType T = Node.getType();
+      Value *OldVal = Builder.CreateLoad(Slot->getAllocatedType(), Slot);
+      Value *One = T == DataType::Float ? ConstantFP::get(DoubleTy, 1.0)
+                                        : ConstantInt::get(Int32Ty, 1);
+      BinaryOp::Operator Op = Node.getOperator() == UnaryOp::Inc ? BinaryOp::Plus
+                                                                : BinaryOp::Minus;
+      Builder.CreateStore(emitArith(Op, OldVal, One, T), Slot);
+      V = OldVal;
     }
 
     virtual void visit(Comparison &Node) override {
-      Node.getLeft()->accept(*this);
-      Value *Left = V;
-      Node.getRight()->accept(*this);
-      Value *Right = V;
+      DataType LTy = Node.getLeft()->getType();
+      DataType RTy = Node.getRight()->getType();
+      DataType T = LTy == DataType::Bool ? DataType::Bool : promote(LTy, RTy);
+      Value *Left = emitAs(Node.getLeft(), T);
+      Value *Right = emitAs(Node.getRight(), T);
+
+      if (T == DataType::Float) {
+        switch (Node.getOperator()) {
+          case Comparison::Equal:
+            V = Builder.CreateFCmpOEQ(Left, Right);
+            break;
+          case Comparison::Not_equal:
+            V = Builder.CreateFCmpUNE(Left, Right);
+            break;
+          case Comparison::Greater:
+            V = Builder.CreateFCmpOGT(Left, Right);
+            break;
+          case Comparison::Less:
+            V = Builder.CreateFCmpOLT(Left, Right);
+            break;
+          case Comparison::Greater_equal:
+            V = Builder.CreateFCmpOGE(Left, Right);
+            break;
+          case Comparison::Less_equal:
+            V = Builder.CreateFCmpOLE(Left, Right);
+            break;
+        }
+        return;
+      }
 
       switch (Node.getOperator()) {
         case Comparison::Equal:
@@ -218,16 +785,75 @@ namespace {
       }
     }
 
+    // Literals, variables and a little arithmetic on them cost less than a
+    // branch and cannot fail, so they may run even when not needed.
+    // Division is left out: a zero divisor is undefined behaviour.
+    static bool isCheap(Expr *E, unsigned Depth) {
+      if (dynCast<Final>(E))
+        return true;
+      BinaryOp *Op = dynCast<BinaryOp>(E);
+      if (!Op || Depth == 0)
+        return false;
+      switch (Op->getOperator()) {
+        case BinaryOp::Plus:
+        case BinaryOp::Minus:
+        case BinaryOp::Mul:
+          return isCheap(Op->getLeft(), Depth - 1) && isCheap(Op->getRight(), Depth - 1);
+        default:
+          return false;
+      }
+    }
+
+    static bool isCheap(Logic *L, unsigned Depth) {
+      if (dynCast<LogicConst>(L))
+        return true;
+      if (Comparison *C = dynCast<Comparison>(L))
+        return isCheap(C->getLeft(), Depth) && isCheap(C->getRight(), Depth);
+      LogicalExpr *E = dynCast<LogicalExpr>(L);
+      return E && Depth > 0 && isCheap(E->getLeft(), Depth - 1) &&
+             isCheap(E->getRight(), Depth - 1);
+    }
+
     virtual void visit(LogicalExpr &Node) override {
+      bool IsAnd = Node.getOperator() == LogicalExpr::And;
       Node.getLeft()->accept(*this);
       Value *Left = V;
+
+      // A cheap right side is computed unconditionally and selected
+      if (isCheap(Node.getRight(), 2)) {
+        Node.getRight()->accept(*this);
+        V = IsAnd ? Builder.CreateSelect(Left, V, ConstantInt::getFalse(M->getContext()))
+                  : Builder.CreateSelect(Left, ConstantInt::getTrue(M->getContext()), V);
+        return;
+      }
+
+      // Otherwise the right side only runs when the left one does not decide
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *LeftBB = Builder.GetInsertBlock();
+      BasicBlock *RightBB = BasicBlock::Create(M->getContext(), IsAnd ? "and.rhs" : "or.rhs",
+                                               TheFunction);
+      BasicBlock *MergeBB = BasicBlock::Create(M->getContext(), IsAnd ? "and.end" : "or.end");
+      if (IsAnd)
+        Builder.CreateCondBr(Left, RightBB, MergeBB);
+      else
+        Builder.CreateCondBr(Left, MergeBB, RightBB);
+
+      Builder.SetInsertPoint(RightBB);
       Node.getRight()->accept(*this);
       Value *Right = V;
+      RightBB = Builder.GetInsertBlock();
+      Builder.CreateBr(MergeBB);
 
-      if (Node.getOperator() == LogicalExpr::And)
-        V = Builder.CreateAnd(Left, Right);
-      else
-        V = Builder.CreateOr(Left, Right);
+      TheFunction->getBasicBlockList().push_back(MergeBB);
+      Builder.SetInsertPoint(MergeBB);
+      PHINode *Result = Builder.CreatePHI(Int1Ty, 2);
+      Result->addIncoming(ConstantInt::get(Int1Ty, !IsAnd), LeftBB);
+      Result->addIncoming(Right, RightBB);
+      V = Result;
+    }
+
+    virtual void visit(LogicConst &Node) override {
+      V = ConstantInt::get(Int1Ty, Node.getValue());
     }
 
     virtual void visit(IfStmt &Node) override {
@@ -242,88 +868,835 @@ namespace {
       Builder.CreateCondBr(Cond, ThenBB, ElseBB);
 
       Builder.SetInsertPoint(ThenBB);
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
-        (*I)->accept(*this);
+      emitBlock(Node.begin(), Node.end());
       Builder.CreateBr(MergeBB);
 
       TheFunction->getBasicBlockList().push_back(ElseBB);
       Builder.SetInsertPoint(ElseBB);
-      for (auto I = Node.beginElse(), E = Node.endElse(); I != E; ++I)
-        (*I)->accept(*this);
+      emitBlock(Node.beginElse(), Node.endElse());
       Builder.CreateBr(MergeBB);
 
       TheFunction->getBasicBlockList().push_back(MergeBB);
       Builder.SetInsertPoint(MergeBB);
     }
 
+    // Header, body, latch and exit blocks with the condition tested on
+    // entry; LLVM rotates the loop itself where that pays off.
     virtual void visit(ForStmt &Node) override {
-      // Simplified - just visit statements
+      // The checked copy of an enclosing loop only runs to fail; it stays
+      // sequential and checks everything
+      if (Node.isParallel() && !CheckHoisted) {
+        emitParallelFor(Node);
+        return;
+      }
+      size_t Mark = enterBlock();
       if (Node.getInit())
         Node.getInit()->accept(*this);
+      BasicBlock *CheckedBB = emitHoistedChecks(Node);
 
       Function *TheFunction = Builder.GetInsertBlock()->getParent();
-      BasicBlock *LoopBB = BasicBlock::Create(M->getContext(), "loop", TheFunction);
-      BasicBlock *AfterBB = BasicBlock::Create(M->getContext(), "afterloop");
+      BasicBlock *ExitBB = BasicBlock::Create(M->getContext(), "for.exit");
+      emitLoop(Node, ExitBB);
+      if (CheckedBB)
+        emitCheckedLoop(Node, CheckedBB, ExitBB);
 
-      Builder.CreateBr(LoopBB);
-      Builder.SetInsertPoint(LoopBB);
-
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
-        (*I)->accept(*this);
+      TheFunction->getBasicBlockList().push_back(ExitBB);
+      Builder.SetInsertPoint(ExitBB);
+      leaveBlock(Mark);
+    }
 
-      if (Node.getIncrement())
-        Node.getIncrement()->accept(*this);
+    // The header, body and latch of Node, leaving to ExitBB.
+    void emitLoop(ForStmt &Node, BasicBlock *ExitBB) {
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *HeaderBB = BasicBlock::Create(M->getContext(), "for.header", TheFunction);
+      BasicBlock *BodyBB = BasicBlock::Create(M->getContext(), "for.body");
+      BasicBlock *LatchBB = BasicBlock::Create(M->getContext(), "for.latch");
+      Builder.CreateBr(HeaderBB);
 
+      Builder.SetInsertPoint(HeaderBB);
       if (Node.getCond()) {
         Node.getCond()->accept(*this);
-        Builder.CreateCondBr(V, LoopBB, AfterBB);
+        BranchInst *Br = Builder.CreateCondBr(V, BodyBB, ExitBB);
+        // Branch weights are where LLVM reads a loop's expected trip count
+        if (Node.getTripCount() > 0) {
+          uint32_t Trips = std::min<int64_t>(Node.getTripCount(), UINT32_MAX);
+          Br->setMetadata(LLVMContext::MD_prof,
+                          MDBuilder(M->getContext()).createBranchWeights(Trips, 1));
+        }
       } else {
-        Builder.CreateBr(LoopBB);
+        Builder.CreateBr(BodyBB);
       }
 
-      TheFunction->getBasicBlockList().push_back(AfterBB);
-      Builder.SetInsertPoint(AfterBB);
+      TheFunction->getBasicBlockList().push_back(BodyBB);
+      Builder.SetInsertPoint(BodyBB);
+      emitLoopBody(Node.releasesArrays(), Node.begin(), Node.end());
+      Builder.CreateBr(LatchBB);
+
+      TheFunction->getBasicBlockList().push_back(LatchBB);
+      Builder.SetInsertPoint(LatchBB);
+      if (Node.getIncrement())
+        Node.getIncrement()->accept(*this);
+      Builder.CreateBr(HeaderBB)->setMetadata(
+          LLVMContext::MD_loop, loopMetadata(Node.begin(), Node.end(), Node.isCounted()));
     }
 
     virtual void visit(ForeachStmt &Node) override {
-      // Placeholder - simplified
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
-        (*I)->accept(*this);
+      // The array is evaluated once; reassigning it in the body does not
+      // change what the loop walks
+      Value *Arr = emitAs(Node.getArray(), DataType::Array);
+      if (Node.isParallel()) {
+        emitParallelForeach(Node, Arr);
+        return;
+      }
+      emitForeachRange(Node, Builder.CreateExtractValue(Arr, 0), Int32Zero,
+                       Builder.CreateExtractValue(Arr, 1));
+    }
+
+    // Walks elements Begin..End-1 of the buffer at Data.
+    void emitForeachRange(ForeachStmt &Node, Value *Data, Value *Begin, Value *End) {
+      emitIndexLoop("foreach", Node.getVar(), Begin, End, Node.releasesArrays(), Node.begin(),
+                    Node.end(), [&](Value *Index) {
+                      return Builder.CreateLoad(Int32Ty,
+                                                Builder.CreateInBoundsGEP(Int32Ty, Data, Index));
+                    });
+    }
+
+    // Runs the statements I..E for each index Begin..End-1, with Var holding
+    // ValueAt(index) and scoped to the loop.
+    void emitIndexLoop(StringRef Prefix, StringRef Var, Value *Begin, Value *End,
+                       bool ReleasesArrays, SmallVector<AST *, 8>::const_iterator I,
+                       SmallVector<AST *, 8>::const_iterator E,
+                       function_ref<Value *(Value *)> ValueAt) {
+      size_t Mark = enterBlock();
+      AllocaInst *Outer = nameMap.lookup(Var);
+      AllocaInst *Elem = createSlot(Int32Ty, Var);
+      Builder.CreateLifetimeStart(Elem);
+      ScopedSlots.push_back(Elem);
+      nameMap[Var] = Elem;
+
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+      BasicBlock *HeaderBB = BasicBlock::Create(M->getContext(), Prefix + ".header", TheFunction);
+      BasicBlock *BodyBB = BasicBlock::Create(M->getContext(), Prefix + ".body", TheFunction);
+      BasicBlock *LatchBB = BasicBlock::Create(M->getContext(), Prefix + ".latch");
+      BasicBlock *ExitBB = BasicBlock::Create(M->getContext(), Prefix + ".exit");
+      Builder.CreateBr(HeaderBB);
+
+      Builder.SetInsertPoint(HeaderBB);
+      PHINode *Index = Builder.CreatePHI(Int32Ty, 2, "idx");
+      Index->addIncoming(Begin, PreheaderBB);
+      Builder.CreateCondBr(Builder.CreateICmpSLT(Index, End), BodyBB, ExitBB);
+
+      Builder.SetInsertPoint(BodyBB);
+      Builder.CreateStore(ValueAt(Index), Elem);
+      emitLoopBody(ReleasesArrays, I, E);
+      Builder.CreateBr(LatchBB);
+
+      TheFunction->getBasicBlockList().push_back(LatchBB);
+      Builder.SetInsertPoint(LatchBB);
+      // Index < End <= INT32_MAX, so the increment cannot wrap
+      Value *Next = Builder.CreateAdd(Index, ConstantInt::get(Int32Ty, 1), "idx.next",
+                                      /*HasNUW=*/true, /*HasNSW=*/true);
+      Index->addIncoming(Next, LatchBB);
+      Builder.CreateBr(HeaderBB)->setMetadata(LLVMContext::MD_loop, loopMetadata(I, E, true));
+
+      TheFunction->getBasicBlockList().push_back(ExitBB);
+      Builder.SetInsertPoint(ExitBB);
+      leaveBlock(Mark);
+      if (Outer)
+        nameMap[Var] = Outer;
+      else
+        nameMap.erase(Var);
+    }
+
+    // A loop for (I = Start; I < End; I += Step) around Body, for the
+    // runtime bookkeeping of parallel loops.
+    void emitStepLoop(StringRef Prefix, Value *Start, Value *End, Value *Step,
+                      function_ref<void(Value *)> Body) {
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+      BasicBlock *HeaderBB = BasicBlock::Create(M->getContext(), Prefix + ".header", TheFunction);
+      BasicBlock *BodyBB = BasicBlock::Create(M->getContext(), Prefix + ".body", TheFunction);
+      BasicBlock *ExitBB = BasicBlock::Create(M->getContext(), Prefix + ".exit", TheFunction);
+      Builder.CreateBr(HeaderBB);
+
+      Builder.SetInsertPoint(HeaderBB);
+      PHINode *I = Builder.CreatePHI(Int32Ty, 2);
+      I->addIncoming(Start, PreheaderBB);
+      Builder.CreateCondBr(Builder.CreateICmpSLT(I, End), BodyBB, ExitBB);
+
+      Builder.SetInsertPoint(BodyBB);
+      Body(I);
+      I->addIncoming(Builder.CreateAdd(I, Step), Builder.GetInsertBlock());
+      Builder.CreateBr(HeaderBB);
+
+      Builder.SetInsertPoint(ExitBB);
+    }
+
+    // Value every thread starts a reduction from.
+    Constant *identity(Reduction::OpKind Op, Type *Ty) {
+      bool IsFloat = Ty == DoubleTy;
+      switch (Op) {
+        case Reduction::Mul:
+          return IsFloat ? ConstantFP::get(DoubleTy, 1.0) : ConstantInt::get(Int32Ty, 1);
+        case Reduction::Max:
+          return IsFloat ? ConstantFP::getInfinity(DoubleTy, true)
+                         : ConstantInt::get(Int32Ty, INT32_MIN, true);
+        default:
+          return Constant::getNullValue(Ty);
+      }
+    }
+
+    Value *combine(Reduction::OpKind Op, Value *L, Value *R) {
+      bool IsFloat = L->getType() == DoubleTy;
+      switch (Op) {
+        case Reduction::Mul:
+          return IsFloat ? Builder.CreateFMul(L, R) : Builder.CreateMul(L, R);
+        case Reduction::Max:
+          return Builder.CreateBinaryIntrinsic(IsFloat ? Intrinsic::maxnum : Intrinsic::smax, L, R);
+        default:
+          return IsFloat ? Builder.CreateFAdd(L, R) : Builder.CreateAdd(L, R);
+      }
+    }
+
+    // The threads walk the buffer of Arr, handed to them as the base.
+    void emitParallelForeach(ForeachStmt &Node, Value *Arr) {
+      SmallVector<Reduction, 4> Reductions;
+      for (auto I = Node.reductionsBegin(), E = Node.reductionsEnd(); I != E; ++I)
+        Reductions.push_back({*I, Reduction::Add});
+      emitParallel(Node, Node.getVar(), Reductions, Builder.CreateExtractValue(Arr, 0),
+                   Builder.CreateExtractValue(Arr, 1),
+                   [&](Value *Begin, Value *End, Value *Data) {
+                     emitForeachRange(Node, Data, Begin, End);
+                   });
+    }
+
+    // for (int i = lo; i < hi; i++) with independent iterations, as marked
+    // by the optimizer; the runtime hands out offsets from lo.
+    void emitParallelFor(ForStmt &Node) {
+      size_t Mark = enterBlock();
+      Node.getInit()->accept(*this);
+      BasicBlock *CheckedBB = emitHoistedChecks(Node);
+
+      StringRef Var = *Node.getInit()->varBegin();
+      Value *Lo = Builder.CreateLoad(Int32Ty, nameMap[Var]);
+      Comparison *Cond = static_cast<Comparison *>(Node.getCond());
+      Value *Hi = emitAs(Cond->getRight(), DataType::Int);
+      // Counted in 64 bits, where no pair of bounds overflows
+      Value *Trips = Builder.CreateSub(Builder.CreateSExt(Hi, Int64Ty),
+                                       Builder.CreateSExt(Lo, Int64Ty));
+      if (Cond->getOperator() == Comparison::Less_equal)
+        Trips = Builder.CreateAdd(Trips, ConstantInt::get(Int64Ty, 1));
+      Trips = Builder.CreateBinaryIntrinsic(Intrinsic::smax, Trips, ConstantInt::get(Int64Ty, 0));
+      Trips = Builder.CreateBinaryIntrinsic(Intrinsic::smin, Trips,
+                                            ConstantInt::get(Int64Ty, INT32_MAX));
+      Value *Length = Builder.CreateTrunc(Trips, Int32Ty);
+
+      SmallVector<Reduction, 4> Reductions(Node.reductionsBegin(), Node.reductionsEnd());
+      emitParallel(Node, Var, Reductions, Lo, Length, [&](Value *Begin, Value *End, Value *Base) {
+        emitIndexLoop("for", Var, Begin, End, Node.releasesArrays(), Node.begin(), Node.end(),
+                      [&](Value *Index) {
+                        return Builder.CreateAdd(Base, Index, "", /*HasNUW=*/false,
+                                                 /*HasNSW=*/true);
+                      });
+      });
+      if (CheckedBB) {
+        BasicBlock *ExitBB = BasicBlock::Create(M->getContext(), "for.exit");
+        Builder.CreateBr(ExitBB);
+        emitCheckedLoop(Node, CheckedBB, ExitBB);
+        Builder.GetInsertBlock()->getParent()->getBasicBlockList().push_back(ExitBB);
+        Builder.SetInsertPoint(ExitBB);
+      }
+      leaveBlock(Mark);
+    }
+
+    // Outlines a loop into a function over a range of its iterations and
+    // hands it to the work-stealing scheduler in rtParallel.c. The function
+    // gets its own copy of every variable the loop reads, passed in an
+    // environment struct together with Base. Each thread folds its ranges
+    // into its own record of partial results, and the records are combined
+    // pairwise in a tree once all threads are done.
+    void emitParallel(AST &Node, StringRef LoopVar, ArrayRef<Reduction> Reductions, Value *Base,
+                      Value *Length, function_ref<void(Value *, Value *, Value *)> EmitLoop) {
+      LLVMContext &Ctx = M->getContext();
+      auto IsReduction = [&](StringRef Name) {
+        return any_of(Reductions, [&](const Reduction &R) { return R.Var == Name; });
+      };
+
+      UseDef Info = Sema::useDef(&Node);
+      SmallVector<StringRef, 8> Captured;
+      for (const auto &Name : Info.Uses)
+        Captured.push_back(Name.getKey());
+      for (const auto &Name : Info.Defs)
+        if (!Info.Uses.count(Name.getKey()))
+          Captured.push_back(Name.getKey());
+      Captured.erase(std::remove_if(Captured.begin(), Captured.end(),
+                                    [&](StringRef Name) {
+                                      return Name == LoopVar || !nameMap.count(Name) ||
+                                             IsReduction(Name);
+                                    }),
+                     Captured.end());
+      std::sort(Captured.begin(), Captured.end());
+
+      // The padding keeps the records of two threads off one cache line
+      SmallVector<Type *, 4> PartialFields;
+      for (const Reduction &R : Reductions)
+        PartialFields.push_back(nameMap[R.Var]->getAllocatedType());
+      PartialFields.push_back(ArrayType::get(Type::getInt8Ty(Ctx), 64));
+      StructType *PartialTy = StructType::create(Ctx, PartialFields, "parallel.partial");
+
+      SmallVector<Type *, 8> Fields;
+      if (Base)
+        Fields.push_back(Base->getType());
+      for (StringRef Name : Captured)
+        Fields.push_back(nameMap[Name]->getAllocatedType());
+      Fields.push_back(PartialTy->getPointerTo());
+      StructType *EnvTy = StructType::create(Ctx, Fields, "parallel.env");
+
+      // One record per thread, on the stack only while the loop runs
+      Value *Threads = Builder.CreateCall(ParallelThreadsFn);
+      Value *StackTop = Builder.CreateIntrinsic(Intrinsic::stacksave, {}, {});
+      AllocaInst *Partials = Builder.CreateAlloca(PartialTy, Threads, "partials");
+      Partials->setAlignment(Align(64));
+      emitStepLoop("partials.init", Int32Zero, Threads, ConstantInt::get(Int32Ty, 1),
+                   [&](Value *T) {
+                     for (unsigned F = 0; F < Reductions.size(); ++F) {
+                       Type *Ty = PartialTy->getElementType(F);
+                       Builder.CreateStore(identity(Reductions[F].Op, Ty),
+                                           Builder.CreateGEP(PartialTy, Partials,
+                                                             {T, Builder.getInt32(F)}));
+                     }
+                   });
+
+      AllocaInst *Env = createSlot(EnvTy, "env");
+      unsigned Field = 0;
+      if (Base)
+        Builder.CreateStore(Base, Builder.CreateStructGEP(EnvTy, Env, Field++));
+      for (StringRef Name : Captured) {
+        AllocaInst *Slot = nameMap[Name];
+        Builder.CreateStore(Builder.CreateLoad(Slot->getAllocatedType(), Slot),
+                            Builder.CreateStructGEP(EnvTy, Env, Field++));
+      }
+      Builder.CreateStore(Partials, Builder.CreateStructGEP(EnvTy, Env, Field));
+
+      Function *Body = emitParallelBody(EnvTy, PartialTy, Base ? Base->getType() : nullptr,
+                                        Captured, Reductions, EmitLoop);
+      Builder.CreateCall(ParallelForFn, {Builder.CreateBitCast(Body, Int8PtrTy),
+                                         Builder.CreateBitCast(Env, Int8PtrTy), Length});
+
+      if (!Reductions.empty()) {
+        // Record I absorbs record I + Stride for Stride = 1, 2, 4, ...
+        Function *TheFunction = Builder.GetInsertBlock()->getParent();
+        BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+        BasicBlock *LevelBB = BasicBlock::Create(Ctx, "tree.level", TheFunction);
+        BasicBlock *PairsBB = BasicBlock::Create(Ctx, "tree.pairs", TheFunction);
+        BasicBlock *DoneBB = BasicBlock::Create(Ctx, "tree.done");
+        Builder.CreateBr(LevelBB);
+
+        Builder.SetInsertPoint(LevelBB);
+        PHINode *Stride = Builder.CreatePHI(Int32Ty, 2, "stride");
+        Stride->addIncoming(ConstantInt::get(Int32Ty, 1), PreheaderBB);
+        Builder.CreateCondBr(Builder.CreateICmpSLT(Stride, Threads), PairsBB, DoneBB);
+
+        Builder.SetInsertPoint(PairsBB);
+        Value *Width = Builder.CreateShl(Stride, 1);
+        emitStepLoop("tree.pair", Int32Zero, Builder.CreateSub(Threads, Stride), Width,
+                     [&](Value *I) {
+                       Value *J = Builder.CreateAdd(I, Stride);
+                       for (unsigned F = 0; F < Reductions.size(); ++F) {
+                         Type *Ty = PartialTy->getElementType(F);
+                         Value *Dst = Builder.CreateGEP(PartialTy, Partials, {I, Builder.getInt32(F)});
+                         Value *Src = Builder.CreateGEP(PartialTy, Partials, {J, Builder.getInt32(F)});
+                         Builder.CreateStore(combine(Reductions[F].Op, Builder.CreateLoad(Ty, Dst),
+                                                     Builder.CreateLoad(Ty, Src)),
+                                             Dst);
+                       }
+                     });
+        Stride->addIncoming(Width, Builder.GetInsertBlock());
+        Builder.CreateBr(LevelBB);
+
+        TheFunction->getBasicBlockList().push_back(DoneBB);
+        Builder.SetInsertPoint(DoneBB);
+        for (unsigned F = 0; F < Reductions.size(); ++F) {
+          AllocaInst *Slot = nameMap[Reductions[F].Var];
+          Type *Ty = Slot->getAllocatedType();
+          Value *Total = Builder.CreateLoad(Ty, Builder.CreateStructGEP(PartialTy, Partials, F));
+          Builder.CreateStore(combine(Reductions[F].Op, Builder.CreateLoad(Ty, Slot), Total), Slot);
+        }
+      }
+      Builder.CreateIntrinsic(Intrinsic::stackrestore, {}, {StackTop});
+    }
+
+    // Emits void parallel.body(i8* env, i32 begin, i32 end, i32 thread).
+    Function *emitParallelBody(StructType *EnvTy, StructType *PartialTy, Type *BaseTy,
+                               ArrayRef<StringRef> Captured, ArrayRef<Reduction> Reductions,
+                               function_ref<void(Value *, Value *, Value *)> EmitLoop) {
+      LLVMContext &Ctx = M->getContext();
+      FunctionType *BodyTy =
+          FunctionType::get(VoidTy, {Int8PtrTy, Int32Ty, Int32Ty, Int32Ty}, false);
+      Function *Body =
+          Function::Create(BodyTy, GlobalValue::InternalLinkage, "parallel.body", M);
+      Body->setDoesNotThrow();
+      Body->addParamAttr(0, Attribute::NoCapture);
+      Argument *EnvArg = Body->getArg(0);
+      Argument *Begin = Body->getArg(1);
+      Argument *End = Body->getArg(2);
+      Argument *Thread = Body->getArg(3);
+      EnvArg->setName("env");
+      Begin->setName("begin");
+      End->setName("end");
+      Thread->setName("thread");
+
+      // The body is emitted with the visitor's own state, which belongs to
+      // the enclosing function until it is done
+      IRBuilderBase::InsertPoint Saved = Builder.saveIP();
+      StringMap<AllocaInst *> OuterNames = nameMap;
+      SmallVector<AllocaInst *, 16> OuterScoped;
+      OuterScoped.swap(ScopedSlots);
+      unsigned OuterDepth = BlockDepth;
+      BlockDepth = 0;
+
+      Builder.SetInsertPoint(BasicBlock::Create(Ctx, "entry", Body));
+      Value *Env = Builder.CreateBitCast(EnvArg, EnvTy->getPointerTo());
+      unsigned Field = 0;
+      Value *Base = nullptr;
+      if (BaseTy)
+        Base = Builder.CreateLoad(BaseTy, Builder.CreateStructGEP(EnvTy, Env, Field++), "base");
+      for (StringRef Name : Captured) {
+        Type *Ty = EnvTy->getElementType(Field);
+        AllocaInst *Slot = createSlot(Ty, Name);
+        Builder.CreateStore(Builder.CreateLoad(Ty, Builder.CreateStructGEP(EnvTy, Env, Field++)),
+                            Slot);
+        nameMap[Name] = Slot;
+      }
+      Value *Partials = Builder.CreateLoad(PartialTy->getPointerTo(),
+                                           Builder.CreateStructGEP(EnvTy, Env, Field));
+      SmallVector<AllocaInst *, 4> Locals;
+      for (unsigned F = 0; F < Reductions.size(); ++F) {
+        Type *Ty = PartialTy->getElementType(F);
+        AllocaInst *Slot = createSlot(Ty, Reductions[F].Var);
+        Builder.CreateStore(identity(Reductions[F].Op, Ty), Slot);
+        nameMap[Reductions[F].Var] = Slot;
+        Locals.push_back(Slot);
+      }
+
+      EmitLoop(Begin, End, Base);
+
+      // Only this thread touches its record while the loop runs
+      for (unsigned F = 0; F < Reductions.size(); ++F) {
+        Type *Ty = PartialTy->getElementType(F);
+        Value *Ptr = Builder.CreateGEP(PartialTy, Partials, {Thread, Builder.getInt32(F)});
+        Builder.CreateStore(combine(Reductions[F].Op, Builder.CreateLoad(Ty, Ptr),
+                                    Builder.CreateLoad(Ty, Locals[F])),
+                            Ptr);
+      }
+      Builder.CreateRetVoid();
+
+      Builder.restoreIP(Saved);
+      nameMap = std::move(OuterNames);
+      ScopedSlots.swap(OuterScoped);
+      BlockDepth = OuterDepth;
+      return Body;
+    }
+
+    // Values Lo..Hi that select arm Arm.
+    struct CaseRange {
+      int64_t Lo, Hi;
+      unsigned Arm;
+    };
+
+    // Up to this many matched values a plain switch is used; LLVM lowers it
+    // to jump tables, bit tests or a balanced tree itself.
+    static const uint64_t MaxSwitchValues = 64;
+    // Ranges covering at least half of a span this small use a lookup table.
+    static const uint64_t MaxTableSpan = 4096;
+
+    // Returns an alternative as an integer range when both ends are
+    // literals a subject of type T can be dispatched on.
+    static bool getCaseRange(const MatchPattern &P, DataType T, int64_t &Lo, int64_t &Hi) {
+      auto GetEnd = [T](Expr *E, int64_t &V) {
+        Final *F = dynCast<Final>(E);
+        if (!F)
+          return false;
+        if (T == DataType::Bool && F->getKind() == Final::Bool) {
+          V = F->getVal() == "true";
+          return true;
+        }
+        return T == DataType::Int && F->getKind() == Final::Number &&
+               !F->getVal().getAsInteger(10, V) && V >= INT32_MIN && V <= INT32_MAX;
+      };
+      return GetEnd(P.Lo, Lo) && GetEnd(P.isRange() ? P.Hi : P.Lo, Hi);
+    }
+
+    // Adds Lo..Hi for Arm to the sorted, disjoint Ranges, leaving out the
+    // values an earlier arm already takes.
+    static void addCaseRange(SmallVectorImpl<CaseRange> &Ranges, int64_t Lo, int64_t Hi,
+                             unsigned Arm) {
+      SmallVector<CaseRange, 4> Pieces;
+      int64_t Next = Lo;
+      for (const CaseRange &R : Ranges) {
+        if (R.Hi < Next)
+          continue;
+        if (R.Lo > Hi)
+          break;
+        if (R.Lo > Next)
+          Pieces.push_back({Next, R.Lo - 1, Arm});
+        Next = R.Hi + 1;
+        if (Next > Hi)
+          break;
+      }
+      if (Next <= Hi)
+        Pieces.push_back({Next, Hi, Arm});
+      Ranges.append(Pieces.begin(), Pieces.end());
+      std::sort(Ranges.begin(), Ranges.end(),
+                [](const CaseRange &A, const CaseRange &B) { return A.Lo < B.Lo; });
+    }
+
+    // Balanced binary search over the range starts: one signed compare per
+    // level, and a single range check at the leaf. The subject is known to
+    // lie in KnownLo..KnownHi.
+    void emitCaseSearch(Value *Key, ArrayRef<CaseRange> Ranges, int64_t KnownLo,
+                        int64_t KnownHi, ArrayRef<BasicBlock *> ArmBBs, BasicBlock *NoMatch) {
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      if (Ranges.size() == 1) {
+        const CaseRange &R = Ranges.front();
+        if (R.Lo <= KnownLo && R.Hi >= KnownHi) {
+          Builder.CreateBr(ArmBBs[R.Arm]);
+          return;
+        }
+        Value *Offset = Builder.CreateSub(Key, ConstantInt::get(Int32Ty, R.Lo, true));
+        Value *InRange = Builder.CreateICmpULE(Offset, ConstantInt::get(Int32Ty, R.Hi - R.Lo));
+        Builder.CreateCondBr(InRange, ArmBBs[R.Arm], NoMatch);
+        return;
+      }
+
+      size_t Mid = Ranges.size() / 2;
+      int64_t Pivot = Ranges[Mid].Lo;
+      BasicBlock *LessBB = BasicBlock::Create(M->getContext(), "match.lt", TheFunction);
+      BasicBlock *GreaterBB = BasicBlock::Create(M->getContext(), "match.ge", TheFunction);
+      Builder.CreateCondBr(Builder.CreateICmpSLT(Key, ConstantInt::get(Int32Ty, Pivot, true)),
+                           LessBB, GreaterBB);
+      Builder.SetInsertPoint(LessBB);
+      emitCaseSearch(Key, Ranges.take_front(Mid), KnownLo, Pivot - 1, ArmBBs, NoMatch);
+      Builder.SetInsertPoint(GreaterBB);
+      emitCaseSearch(Key, Ranges.drop_front(Mid), Pivot, KnownHi, ArmBBs, NoMatch);
+    }
+
+    // Maps each value of Span (starting at Lo) to its arm number plus one
+    // in a constant table, then switches on the small, dense arm number.
+    void emitCaseTable(Value *Key, ArrayRef<CaseRange> Ranges, uint64_t Span,
+                       ArrayRef<BasicBlock *> ArmBBs, BasicBlock *NoMatch) {
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      int64_t Lo = Ranges.front().Lo;
+      SmallVector<uint16_t, 64> Entries(Span, 0);
+      for (const CaseRange &R : Ranges)
+        for (int64_t Val = R.Lo; Val <= R.Hi; ++Val)
+          Entries[Val - Lo] = R.Arm + 1;
+
+      Constant *Init;
+      if (ArmBBs.size() < 255) {
+        SmallVector<uint8_t, 64> Bytes(Entries.begin(), Entries.end());
+        Init = ConstantDataArray::get(M->getContext(), Bytes);
+      } else {
+        Init = ConstantDataArray::get(M->getContext(), Entries);
+      }
+      GlobalVariable *Table = new GlobalVariable(*M, Init->getType(), true,
+                                                 GlobalValue::PrivateLinkage, Init, "match.table");
+      Table->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+      Value *Offset = Builder.CreateSub(Key, ConstantInt::get(Int32Ty, Lo, true));
+      BasicBlock *LookupBB = BasicBlock::Create(M->getContext(), "match.lookup", TheFunction);
+      Builder.CreateCondBr(Builder.CreateICmpULT(Offset, ConstantInt::get(Int32Ty, Span)),
+                           LookupBB, NoMatch);
+
+      Builder.SetInsertPoint(LookupBB);
+      Type *EntryTy = cast<ArrayType>(Init->getType())->getElementType();
+      Value *Slot = Builder.CreateInBoundsGEP(
+          Init->getType(), Table, {ConstantInt::get(Int64Ty, 0), Builder.CreateZExt(Offset, Int64Ty)});
+      Value *Entry = Builder.CreateLoad(EntryTy, Slot);
+      SwitchInst *Switch = Builder.CreateSwitch(Entry, NoMatch, ArmBBs.size());
+      for (unsigned I = 0, E = ArmBBs.size(); I != E; ++I)
+        Switch->addCase(cast<ConstantInt>(ConstantInt::get(EntryTy, I + 1)), ArmBBs[I]);
+    }
+
+    // Sends Key to the arm whose range holds it, or to NoMatch.
+    void emitCaseDispatch(Value *Key, DataType KeyTy, SmallVectorImpl<CaseRange> &Ranges,
+                          ArrayRef<BasicBlock *> ArmBBs, BasicBlock *NoMatch) {
+      // Neighbouring ranges of one arm are one range
+      SmallVector<CaseRange, 16> Merged;
+      for (const CaseRange &R : Ranges) {
+        if (!Merged.empty() && Merged.back().Arm == R.Arm && Merged.back().Hi + 1 == R.Lo)
+          Merged.back().Hi = R.Hi;
+        else
+          Merged.push_back(R);
+      }
+      if (Merged.empty()) {
+        Builder.CreateBr(NoMatch);
+        return;
+      }
+
+      uint64_t Values = 0;
+      for (const CaseRange &R : Merged)
+        Values += R.Hi - R.Lo + 1;
+      uint64_t Span = Merged.back().Hi - Merged.front().Lo + 1;
+
+      if (Values <= MaxSwitchValues) {
+        SwitchInst *Switch = Builder.CreateSwitch(Key, NoMatch, Values);
+        for (const CaseRange &R : Merged)
+          for (int64_t Val = R.Lo; Val <= R.Hi; ++Val)
+            Switch->addCase(cast<ConstantInt>(ConstantInt::get(Int32Ty, Val, true)),
+                            ArmBBs[R.Arm]);
+      } else if (Span <= MaxTableSpan && Values * 2 >= Span) {
+        emitCaseTable(Key, Merged, Span, ArmBBs, NoMatch);
+      } else {
+        bool IsBool = KeyTy == DataType::Bool;
+        emitCaseSearch(Key, Merged, IsBool ? 0 : INT32_MIN, IsBool ? 1 : INT32_MAX,
+                       ArmBBs, NoMatch);
+      }
+    }
+
+    // Tests whether Subject matches P with the promotions Comparison uses.
+    Value *emitPatternTest(Value *Subject, DataType SubjectTy, const MatchPattern &P) {
+      auto Compare = [&](Expr *Pattern, CmpInst::Predicate IntPred, CmpInst::Predicate FloatPred) {
+        DataType T = SubjectTy == DataType::Bool ? DataType::Bool
+                                                 : promote(SubjectTy, Pattern->getType());
+        Value *Left = convert(Subject, SubjectTy, T);
+        Value *Right = emitAs(Pattern, T);
+        return T == DataType::Float ? Builder.CreateFCmp(FloatPred, Left, Right)
+                                    : Builder.CreateICmp(IntPred, Left, Right);
+      };
+      if (!P.isRange())
+        return Compare(P.Lo, CmpInst::ICMP_EQ, CmpInst::FCMP_OEQ);
+      Value *AboveLo = Compare(P.Lo, CmpInst::ICMP_SGE, CmpInst::FCMP_OGE);
+      return Builder.CreateAnd(AboveLo, Compare(P.Hi, CmpInst::ICMP_SLE, CmpInst::FCMP_OLE));
     }
 
     virtual void visit(MatchStmt &Node) override {
-      // Placeholder - simplified
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
-        (*I)->accept(*this);
+      DataType SubjectTy = Node.getValue()->getType();
+      Node.getValue()->accept(*this);
+      Value *Subject = V;
+      Value *Key = SubjectTy == DataType::Bool ? Builder.CreateZExt(Subject, Int32Ty) : Subject;
+
+      // Arms after the first default can never run
+      SmallVector<MatchCase *, 8> Arms;
+      MatchCase *Default = nullptr;
+      for (auto I = Node.begin(), E = Node.end(); I != E && !Default; ++I) {
+        if ((*I)->isDefault())
+          Default = *I;
+        else
+          Arms.push_back(*I);
+      }
+
+      Function *TheFunction = Builder.GetInsertBlock()->getParent();
+      BasicBlock *MergeBB = BasicBlock::Create(M->getContext(), "matchcont");
+      BasicBlock *DefaultBB =
+          Default ? BasicBlock::Create(M->getContext(), "match.default") : MergeBB;
+      SmallVector<BasicBlock *, 8> ArmBBs;
+      for (unsigned I = 0, E = Arms.size(); I != E; ++I)
+        ArmBBs.push_back(BasicBlock::Create(M->getContext(), "match.arm"));
+
+      // Runs of arms with literal patterns share one dispatch; an arm known
+      // only at run time is compared where it appears, so the first match
+      // still wins
+      SmallVector<CaseRange, 16> Run;
+      for (unsigned I = 0, E = Arms.size(); I != E; ++I) {
+        SmallVector<CaseRange, 2> Alternatives;
+        bool Literal = SubjectTy == DataType::Int || SubjectTy == DataType::Bool;
+        for (auto P = Arms[I]->patBegin(), PE = Arms[I]->patEnd(); P != PE && Literal; ++P) {
+          int64_t Lo, Hi;
+          Literal = getCaseRange(*P, SubjectTy, Lo, Hi);
+          Alternatives.push_back({Lo, Hi, I});
+        }
+        if (Literal) {
+          for (const CaseRange &R : Alternatives)
+            if (R.Lo <= R.Hi)
+              addCaseRange(Run, R.Lo, R.Hi, I);
+          continue;
+        }
+
+        BasicBlock *TestBB = BasicBlock::Create(M->getContext(), "match.test", TheFunction);
+        emitCaseDispatch(Key, SubjectTy, Run, ArmBBs, TestBB);
+        Run.clear();
+
+        Builder.SetInsertPoint(TestBB);
+        for (auto P = Arms[I]->patBegin(), PE = Arms[I]->patEnd(); P != PE; ++P) {
+          BasicBlock *NextBB = BasicBlock::Create(M->getContext(), "match.next", TheFunction);
+          Builder.CreateCondBr(emitPatternTest(Subject, SubjectTy, *P), ArmBBs[I], NextBB);
+          Builder.SetInsertPoint(NextBB);
+        }
+      }
+      emitCaseDispatch(Key, SubjectTy, Run, ArmBBs, DefaultBB);
+
+      for (unsigned I = 0, E = Arms.size(); I != E; ++I) {
+        TheFunction->getBasicBlockList().push_back(ArmBBs[I]);
+        Builder.SetInsertPoint(ArmBBs[I]);
+        Arms[I]->accept(*this);
+        Builder.CreateBr(MergeBB);
+      }
+      if (Default) {
+        TheFunction->getBasicBlockList().push_back(DefaultBB);
+        Builder.SetInsertPoint(DefaultBB);
+        Default->accept(*this);
+        Builder.CreateBr(MergeBB);
+      }
+
+      TheFunction->getBasicBlockList().push_back(MergeBB);
+      Builder.SetInsertPoint(MergeBB);
     }
 
     virtual void visit(MatchCase &Node) override {
-      for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
-        (*I)->accept(*this);
+      emitBlock(Node.begin(), Node.end());
     }
 
     virtual void visit(PrintStmt &Node) override {
-      Node.getValue()->accept(*this);
-      Value *Val = V;
-
-      // Create format string
-      Value *FormatStr = Builder.CreateGlobalStringPtr("%d\n");
-      Builder.CreateCall(PrintfFn, {FormatStr, Val});
+      // Bools print as 0/1 like ints
+      bool IsFloat = Node.getValue()->getType() == DataType::Float;
+      Value *Val = emitAs(Node.getValue(), IsFloat ? DataType::Float : DataType::Int);
+      Builder.CreateCall(IsFloat ? PrintF64Fn : PrintI32Fn, {Val});
     }
 
+    // Builtins become single instructions or intrinsics wherever possible so
+    // that LLVM can fold and hoist them like any other arithmetic.
     virtual void visit(FunctionCall &Node) override {
-      // Placeholder - simplified
-      V = Int32Zero;
+      auto Arg = Node.argsBegin();
+      DataType T = Node.getType();
+      switch (Node.getFunction()) {
+        case FunctionCall::ToInt:
+        case FunctionCall::ToFloat:
+        case FunctionCall::ToBool:
+          V = emitAs(*Arg, T);
+          break;
+        case FunctionCall::Abs:
+          // abs(INT32_MIN) wraps to itself, as in the constant folder
+          V = emitAs(*Arg, T);
+          V = T == DataType::Float
+                  ? Builder.CreateUnaryIntrinsic(Intrinsic::fabs, V)
+                  : Builder.CreateBinaryIntrinsic(Intrinsic::abs, V,
+                                                  ConstantInt::getFalse(M->getContext()));
+          break;
+        case FunctionCall::Max:
+          if (Node.argsEnd() - Arg == 1) {
+            Value *Arr = emitAs(*Arg, DataType::Array);
+            V = Builder.CreateCall(MaxFn, {Builder.CreateExtractValue(Arr, 0),
+                                           Builder.CreateExtractValue(Arr, 1)});
+          } else {
+            Value *Left = emitAs(Arg[0], T);
+            Value *Right = emitAs(Arg[1], T);
+            V = Builder.CreateBinaryIntrinsic(
+                T == DataType::Float ? Intrinsic::maxnum : Intrinsic::smax, Left, Right);
+          }
+          break;
+        case FunctionCall::Length:
+          V = Builder.CreateExtractValue(emitAs(*Arg, DataType::Array), 1);
+          break;
+        case FunctionCall::Index: {
+          // index(arr, i) reads arr[i] under the same check as an access
+          Value *Arr = emitAs(Arg[0], DataType::Array);
+          Value *Idx = emitAs(Arg[1], DataType::Int);
+          if (BoundsChecks)
+            emitBoundsCheck(Idx, Builder.CreateExtractValue(Arr, 1));
+          Value *Data = Builder.CreateExtractValue(Arr, 0);
+          V = Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(Int32Ty, Data, Idx));
+          break;
+        }
+        case FunctionCall::Find: {
+          Value *Arr = emitAs(Arg[0], DataType::Array);
+          Value *Needle = emitAs(Arg[1], DataType::Int);
+          V = Builder.CreateCall(FindFn, {Builder.CreateExtractValue(Arr, 0),
+                                          Builder.CreateExtractValue(Arr, 1), Needle});
+          break;
+        }
+        case FunctionCall::Read:
+          V = Builder.CreateCall(ReadI32Fn);
+          break;
+        case FunctionCall::ReadFloat:
+          V = Builder.CreateCall(ReadF64Fn);
+          break;
+        case FunctionCall::ReadArray: {
+          // A negative count reads nothing; the runtime fills the whole
+          // buffer in one call
+          Value *Count = Builder.CreateBinaryIntrinsic(Intrinsic::smax, emitAs(*Arg, DataType::Int),
+                                                       Int32Zero);
+          Value *Bytes = Builder.CreateMul(Builder.CreateZExt(Count, Int64Ty),
+                                           ConstantInt::get(Int64Ty, 4));
+          Value *Data = Builder.CreateBitCast(Builder.CreateCall(AllocFn, {Bytes}), Int32PtrTy);
+          Builder.CreateCall(ReadArrayFn, {Data, Count});
+          V = makeArray(Data, Count);
+          break;
+        }
+      }
+    }
+
+    // Returns the elements of a literal as a constant, or null if any of
+    // them is only known at run time.
+    Constant *getConstantElements(ArrayLiteral &Node) {
+      SmallVector<uint32_t, 16> Elements;
+      for (auto I = Node.begin(), E = Node.end(); I != E; ++I) {
+        Final *F = dynCast<Final>(*I);
+        int32_t Elem;
+        if (!F || F->getKind() != Final::Number || F->getVal().getAsInteger(10, Elem))
+          return nullptr;
+        Elements.push_back(Elem);
+      }
+      return ConstantDataArray::get(M->getContext(), Elements);
     }
 
     virtual void visit(ArrayLiteral &Node) override {
-      // Placeholder - simplified
-      V = Int32Zero;
+      unsigned Size = Node.size();
+      Value *Length = ConstantInt::get(Int32Ty, Size);
+
+      // Constant tables live in .rodata; read-only ones are used in place
+      GlobalVariable *Table = nullptr;
+      if (Constant *Init = Size ? getConstantElements(Node) : nullptr) {
+        Table = new GlobalVariable(*M, Init->getType(), true,
+                                   GlobalValue::PrivateLinkage, Init, "table");
+        Table->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+        Table->setAlignment(Align(4));
+        if (Node.isReadOnly()) {
+          V = makeArray(Builder.CreateConstInBoundsGEP2_32(Init->getType(), Table, 0, 0),
+                        Length);
+          return;
+        }
+      }
+
+      Value *Data;
+      if (Size == 0) {
+        Data = ConstantPointerNull::get(cast<PointerType>(Int32PtrTy));
+      } else if (Node.isOnStack()) {
+        // The previous value is dead by now, so one buffer serves
+        AllocaInst *Buffer = createSlot(ArrayType::get(Int32Ty, Size), "arr");
+        Data = Builder.CreateConstInBoundsGEP2_32(Buffer->getAllocatedType(), Buffer, 0, 0);
+      } else {
+        Value *Bytes = ConstantInt::get(Int64Ty, uint64_t(Size) * 4);
+        Data = Builder.CreateBitCast(Builder.CreateCall(AllocFn, {Bytes}), Int32PtrTy);
+      }
+
+      if (Table) {
+        Builder.CreateMemCpy(Data, Align(4), Table, Align(4), uint64_t(Size) * 4);
+      } else {
+        unsigned Idx = 0;
+        for (auto I = Node.begin(), E = Node.end(); I != E; ++I, ++Idx) {
+          Value *Elem = emitAs(*I, DataType::Int);
+          Builder.CreateStore(Elem, Builder.CreateConstInBoundsGEP1_32(Int32Ty, Data, Idx));
+        }
+      }
+      V = makeArray(Data, Length);
     }
 
     virtual void visit(ArrayAccess &Node) override {
-      // Placeholder - simplified
-      V = Int32Zero;
+      V = Builder.CreateLoad(Int32Ty, emitElementPtr(Node));
+    }
+
+    // A slice is a descriptor into the parent's buffer; nothing is copied.
+    virtual void visit(ArraySlice &Node) override {
+      Value *Arr = Builder.CreateLoad(ArrayTy, nameMap[Node.getArrayName()]);
+      Value *Length = Builder.CreateExtractValue(Arr, 1);
+      Value *Lo = Node.getLo() ? emitAs(Node.getLo(), DataType::Int) : Int32Zero;
+      Value *Hi = Node.getHi() ? emitAs(Node.getHi(), DataType::Int) : Length;
+      if (BoundsChecks)
+        emitSliceCheck(Lo, Hi, Length);
+      Value *Data = Builder.CreateInBoundsGEP(Int32Ty, Builder.CreateExtractValue(Arr, 0), Lo);
+      V = makeArray(Data, Builder.CreateSub(Hi, Lo));
     }
   };
 }
@@ -332,7 +1705,7 @@ void CodeGen::compile(Program *Tree) {
   LLVMContext Ctx;
   Module *M = new Module("simple-compiler", Ctx);
 
-  ToIRVisitor *ToIR = new ToIRVisitor(M);
+  ToIRVisitor *ToIR = new ToIRVisitor(M, BoundsChecks, AsyncOutput);
   ToIR->run(Tree);
 
   M->print(outs(), nullptr);
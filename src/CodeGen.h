@@ -5,7 +5,13 @@
 
 class CodeGen
 {
+ bool BoundsChecks;
+ bool AsyncOutput;
+
 public:
+ CodeGen(bool BoundsChecks = true, bool AsyncOutput = false)
+     : BoundsChecks(BoundsChecks), AsyncOutput(AsyncOutput) {}
+
  void compile(Program *Tree);
 
 };
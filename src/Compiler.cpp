@@ -1,4 +1,5 @@
 #include "CodeGen.h"
+#include "Optimizer.h"
 #include "Parser.h"
 #include "Sema.h"
 #include "llvm/Support/CommandLine.h"
@@ -11,6 +12,26 @@ static llvm::cl::opt<std::string>
           llvm::cl::desc("<input expression>"),
           llvm::cl::init(""));
 
+static llvm::cl::opt<bool>
+    BoundsReport("bounds-report",
+                 llvm::cl::desc("Report how many array bounds checks were removed"),
+                 llvm::cl::init(false));
+
+static llvm::cl::opt<bool>
+    BoundsChecks("bounds-checks",
+                 llvm::cl::desc("Check array indices at run time"),
+                 llvm::cl::init(true));
+
+static llvm::cl::opt<bool>
+    AsyncOutput("async-output",
+                llvm::cl::desc("Write program output from a separate I/O thread"),
+                llvm::cl::init(false));
+
+static llvm::cl::opt<bool>
+    AutoParallel("auto-parallel",
+                 llvm::cl::desc("Run reduction loops over all cores"),
+                 llvm::cl::init(false));
+
 // The main function of the program.
 int main(int argc, const char **argv)
 {
@@ -44,8 +65,12 @@ int main(int argc, const char **argv)
         return 1;
     }
 
+    // Fold constants before code generation.
+    Optimizer Opt(BoundsReport, AutoParallel);
+    Opt.optimize(Tree);
+
     // Generate code for the AST using a code generator.
-    CodeGen CodeGenerator;
+    CodeGen CodeGenerator(BoundsChecks, AsyncOutput);
     CodeGenerator.compile(Tree);
 
     // The program executed successfully.
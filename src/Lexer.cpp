@@ -23,7 +23,8 @@ namespace charinfo
     LLVM_READNONE inline bool isSpecialSign(char c)
     {
         return c == '/' || c == '%' || c == '-' || c == '+' || c == '^' ||
-               c == '*' || c == '<' || c == '>' || c == '=' || c == '!';
+               c == '*' || c == '<' || c == '>' || c == '=' || c == '!' ||
+               c == '|' || c == '&';
     }
 }
 
@@ -93,6 +94,10 @@ void Lexer::next(Token &token)
             kind = Token::KW_foreach;
         else if (Name == "in")
             kind = Token::KW_in;
+        else if (Name == "parallel")
+            kind = Token::KW_parallel;
+        else if (Name == "reduce")
+            kind = Token::KW_reduce;
         else if (Name == "match")
             kind = Token::KW_match;
         else if (Name == "print")
@@ -135,6 +140,12 @@ void Lexer::next(Token &token)
             kind = Token::KW_index;
         else if (Name == "find")
             kind = Token::KW_find;
+        else if (Name == "read")
+            kind = Token::KW_read;
+        else if (Name == "read_float")
+            kind = Token::KW_read_float;
+        else if (Name == "read_array")
+            kind = Token::KW_read_array;
         else
             kind = Token::ident;
         // generate the token
@@ -205,6 +216,8 @@ void Lexer::next(Token &token)
             kind = Token::decrement;
         else if (Sign == "->")
             kind = Token::arrow;
+        else if (Sign == "|")
+            kind = Token::pipe;
         else if (Sign == "+")
             kind = Token::plus;
         else if (Sign == "-")
@@ -224,6 +237,11 @@ void Lexer::next(Token &token)
         return;
     }
     
+    else if (*BufferPtr == '.' && *(BufferPtr + 1) == '.')
+    {
+        formToken(token, BufferPtr + 2, Token::dotdot);
+        return;
+    }
     else
     {
         switch (*BufferPtr)
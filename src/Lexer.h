@@ -51,6 +51,8 @@ public:
         l_bracket,      // [
         r_bracket,      // ]
         arrow,          // ->
+        pipe,           // |
+        dotdot,         // ..
         KW_var,         // var
         KW_int,         // int
         KW_bool,        // bool
@@ -63,6 +65,8 @@ public:
         KW_for,         // for
         KW_foreach,     // foreach
         KW_in,          // in
+        KW_parallel,    // parallel
+        KW_reduce,      // reduce
         KW_match,       // match
         KW_print,       // print
         KW_ADD,         // ADD
@@ -83,7 +87,10 @@ public:
         KW_length,      // length
         KW_max,         // max
         KW_index,       // index (changed from Index)
-        KW_find         // find
+        KW_find,        // find
+        KW_read,        // read
+        KW_read_float,  // read_float
+        KW_read_array   // read_array
     };
 
 private:
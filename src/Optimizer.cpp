@@ -0,0 +1,2041 @@
+#include "Optimizer.h"
+#include "Sema.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cmath>
+#include <cstdint>
+
+namespace {
+// A compile-time value of one of the scalar types.
+struct ConstValue {
+  DataType Ty;
+  int32_t Int;
+  double Float;
+  bool Bool;
+
+  static ConstValue getInt(int32_t V) { return {DataType::Int, V, 0.0, false}; }
+  static ConstValue getFloat(double V) { return {DataType::Float, 0, V, false}; }
+  static ConstValue getBool(bool V) { return {DataType::Bool, 0, 0.0, V}; }
+};
+
+// Converts C to type To with the semantics of the IR CodeGen emits;
+// fails where that conversion would be poison.
+bool convertConst(ConstValue C, DataType To, ConstValue &Out) {
+  if (C.Ty == To) {
+    Out = C;
+    return true;
+  }
+  switch (To) {
+    case DataType::Int:
+      if (C.Ty == DataType::Bool) {
+        Out = ConstValue::getInt(C.Bool);
+        return true;
+      }
+      if (!std::isfinite(C.Float) || std::trunc(C.Float) < INT32_MIN ||
+          std::trunc(C.Float) > INT32_MAX)
+        return false;
+      Out = ConstValue::getInt(static_cast<int32_t>(C.Float));
+      return true;
+    case DataType::Float:
+      Out = ConstValue::getFloat(C.Ty == DataType::Bool ? C.Bool : C.Int);
+      return true;
+    case DataType::Bool:
+      Out = ConstValue::getBool(C.Ty == DataType::Int ? C.Int != 0
+                                                      : C.Float != 0.0);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Two's complement wrap-around, matching i32 add/sub/mul.
+int32_t wrap(int64_t V) {
+  return static_cast<int32_t>(static_cast<uint32_t>(V));
+}
+
+bool evalArith(BinaryOp::Operator Op, ConstValue L, ConstValue R,
+               DataType Ty, ConstValue &Out) {
+  if (!convertConst(L, Ty, L) || !convertConst(R, Ty, R))
+    return false;
+
+  if (Ty == DataType::Float) {
+    double V;
+    switch (Op) {
+      case BinaryOp::Plus:
+        V = L.Float + R.Float;
+        break;
+      case BinaryOp::Minus:
+        V = L.Float - R.Float;
+        break;
+      case BinaryOp::Mul:
+        V = L.Float * R.Float;
+        break;
+      case BinaryOp::Div:
+        V = L.Float / R.Float;
+        break;
+      case BinaryOp::Mod:
+        V = std::fmod(L.Float, R.Float);
+        break;
+      case BinaryOp::Exp:
+        V = std::pow(L.Float, R.Float);
+        break;
+    }
+    // Leave inf and nan to the runtime rather than spelling them as literals
+    if (!std::isfinite(V))
+      return false;
+    Out = ConstValue::getFloat(V);
+    return true;
+  }
+
+  int64_t A = L.Int, B = R.Int;
+  switch (Op) {
+    case BinaryOp::Plus:
+      Out = ConstValue::getInt(wrap(A + B));
+      return true;
+    case BinaryOp::Minus:
+      Out = ConstValue::getInt(wrap(A - B));
+      return true;
+    case BinaryOp::Mul:
+      Out = ConstValue::getInt(wrap(A * B));
+      return true;
+    case BinaryOp::Div:
+    case BinaryOp::Mod:
+      // Keep the runtime trap for division by zero and INT_MIN / -1
+      if (B == 0 || (A == INT32_MIN && B == -1))
+        return false;
+      Out = ConstValue::getInt(Op == BinaryOp::Div ? A / B : A % B);
+      return true;
+    case BinaryOp::Exp: {
+      if (B < 0) {
+        // 1 / A^-B truncated like /; 0 keeps its runtime trap
+        if (A == 0)
+          return false;
+        int64_t Inverse = 1 / A;
+        Out = ConstValue::getInt(B & 1 ? Inverse : Inverse * Inverse);
+        return true;
+      }
+      int32_t Result = 1, Base = L.Int;
+      for (; B; B >>= 1) {
+        if (B & 1)
+          Result = wrap(static_cast<int64_t>(Result) * Base);
+        Base = wrap(static_cast<int64_t>(Base) * Base);
+      }
+      Out = ConstValue::getInt(Result);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads E if it is a literal.
+bool getLiteral(Expr *E, ConstValue &C) {
+  Final *F = dynCast<Final>(E);
+  if (!F)
+    return false;
+  switch (F->getKind()) {
+    case Final::Number: {
+      int32_t V;
+      if (F->getVal().getAsInteger(10, V))
+        return false;
+      C = ConstValue::getInt(V);
+      return true;
+    }
+    case Final::Float: {
+      double V;
+      if (F->getVal().getAsDouble(V))
+        return false;
+      C = ConstValue::getFloat(V);
+      return true;
+    }
+    case Final::Bool:
+      C = ConstValue::getBool(F->getVal() == "true");
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool evalCompare(Comparison::Operator Op, ConstValue L, ConstValue R) {
+  if (L.Ty == DataType::Bool) {
+    return Op == Comparison::Equal ? L.Bool == R.Bool : L.Bool != R.Bool;
+  }
+  DataType Ty = (L.Ty == DataType::Float || R.Ty == DataType::Float)
+                    ? DataType::Float
+                    : DataType::Int;
+  convertConst(L, Ty, L);
+  convertConst(R, Ty, R);
+  double A = Ty == DataType::Float ? L.Float : L.Int;
+  double B = Ty == DataType::Float ? R.Float : R.Int;
+  switch (Op) {
+    case Comparison::Equal:
+      return A == B;
+    case Comparison::Not_equal:
+      return A != B;
+    case Comparison::Greater:
+      return A > B;
+    case Comparison::Less:
+      return A < B;
+    case Comparison::Greater_equal:
+      return A >= B;
+    case Comparison::Less_equal:
+      return A <= B;
+  }
+  return false;
+}
+
+// Folds constant subexpressions and propagates the values of variables
+// that are never written after their declaration.
+class ConstantFolder : public ASTVisitor {
+  UseDef Info;
+  llvm::StringMap<ConstValue> Constants;
+
+  // Result of the last visited expression or condition
+  Expr *Result;
+  Logic *LogicResult;
+  bool Known;
+  ConstValue Value;
+
+  // Elements of the last visited array literal, if all are known
+  bool KnownArray;
+  llvm::SmallVector<int32_t, 8> ArrayValue;
+
+  Expr *fold(Expr *E) {
+    Result = E;
+    Known = false;
+    KnownArray = false;
+    E->accept(*this);
+    return Result;
+  }
+
+  Logic *foldLogic(Logic *L) {
+    LogicResult = L;
+    Known = false;
+    L->accept(*this);
+    return LogicResult;
+  }
+
+  static Final *makeFinal(ConstValue C) {
+    Final *F;
+    switch (C.Ty) {
+      case DataType::Float: {
+        std::string Text;
+        llvm::raw_string_ostream(Text) << llvm::format("%.17g", C.Float);
+        F = new Final(Final::Float, Text);
+        break;
+      }
+      case DataType::Bool:
+        F = new Final(Final::Bool, C.Bool ? "true" : "false");
+        break;
+      default:
+        F = new Final(Final::Number, std::to_string(C.Int));
+        break;
+    }
+    F->setType(C.Ty);
+    return F;
+  }
+
+  void setConst(ConstValue C) {
+    Known = true;
+    Value = C;
+    Result = makeFinal(C);
+  }
+
+  void setLogic(bool B) {
+    Known = true;
+    Value = ConstValue::getBool(B);
+    LogicResult = new LogicConst(B);
+  }
+
+  void record(llvm::StringRef Var, DataType Ty, bool HasValue) {
+    ConstValue C;
+    bool Scalar = Ty == DataType::Int || Ty == DataType::Float || Ty == DataType::Bool;
+    if (!Scalar || Info.Defs.count(Var)) {
+      Constants.erase(Var);
+      return;
+    }
+    // A variable declared without a value keeps its zero default
+    if (!HasValue)
+      convertConst(ConstValue::getInt(0), Ty, C);
+    else if (!Known || !convertConst(Value, Ty, C)) {
+      Constants.erase(Var);
+      return;
+    }
+    Constants[Var] = C;
+  }
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+public:
+  ConstantFolder(Program *Tree) : Info(Sema::useDef(Tree)) {}
+
+  virtual void visit(Program &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(Final &Node) override {
+    if (Node.getKind() != Final::Ident) {
+      Known = getLiteral(&Node, Value);
+      return;
+    }
+    auto I = Constants.find(Node.getVal());
+    if (I != Constants.end())
+      setConst(I->second);
+  }
+
+  virtual void visit(BinaryOp &Node) override {
+    Node.setLeft(fold(Node.getLeft()));
+    bool LeftKnown = Known;
+    ConstValue L = Value;
+    Node.setRight(fold(Node.getRight()));
+    bool RightKnown = Known;
+    ConstValue R = Value;
+
+    Result = &Node;
+    Known = false;
+    ConstValue C;
+    if (LeftKnown && RightKnown &&
+        evalArith(Node.getOperator(), L, R, Node.getType(), C))
+      setConst(C);
+  }
+
+  virtual void visit(UnaryOp &Node) override {}
+
+  virtual void visit(Assignment &Node) override {
+    if (Node.getElement())
+      fold(Node.getElement());
+    Node.setRight(fold(Node.getRight()));
+  }
+
+  virtual void visit(SpecialAssignment &Node) override {}
+
+  virtual void visit(Declaration &Node) override {
+    auto Val = Node.valBegin();
+    unsigned Idx = 0;
+    for (auto I = Node.varBegin(), E = Node.varEnd(); I != E; ++I) {
+      bool HasValue = Val != Node.valEnd();
+      if (HasValue) {
+        Node.setValue(Idx++, fold(*Val));
+        ++Val;
+      }
+      record(*I, Node.getType(), HasValue);
+    }
+  }
+
+  virtual void visit(Comparison &Node) override {
+    Node.setLeft(fold(Node.getLeft()));
+    bool LeftKnown = Known;
+    ConstValue L = Value;
+    Node.setRight(fold(Node.getRight()));
+    bool RightKnown = Known;
+    ConstValue R = Value;
+
+    LogicResult = &Node;
+    Known = false;
+    if (LeftKnown && RightKnown)
+      setLogic(evalCompare(Node.getOperator(), L, R));
+  }
+
+  virtual void visit(LogicalExpr &Node) override {
+    Node.setLeft(foldLogic(Node.getLeft()));
+    bool LeftKnown = Known;
+    bool L = Value.Bool;
+    Node.setRight(foldLogic(Node.getRight()));
+    bool RightKnown = Known;
+    bool R = Value.Bool;
+
+    bool IsAnd = Node.getOperator() == LogicalExpr::And;
+    LogicResult = &Node;
+    Known = false;
+    if (LeftKnown && RightKnown) {
+      setLogic(IsAnd ? L && R : L || R);
+    } else if (LeftKnown) {
+      // The right operand is only evaluated when the left one does not decide
+      if (L == IsAnd)
+        LogicResult = Node.getRight();
+      else
+        setLogic(L);
+    } else if (RightKnown && R == IsAnd) {
+      LogicResult = Node.getLeft();
+    }
+  }
+
+  virtual void visit(LogicConst &Node) override {
+    Known = true;
+    Value = ConstValue::getBool(Node.getValue());
+  }
+
+  virtual void visit(IfStmt &Node) override {
+    Node.setCond(foldLogic(Node.getCond()));
+    visitStmts(Node.begin(), Node.end());
+    visitStmts(Node.beginElse(), Node.endElse());
+  }
+
+  virtual void visit(ForStmt &Node) override {
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    if (Node.getCond())
+      Node.setCond(foldLogic(Node.getCond()));
+    if (Node.getIncrement())
+      Node.getIncrement()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.setArray(fold(Node.getArray()));
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(MatchStmt &Node) override {
+    Node.setValue(fold(Node.getValue()));
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(MatchCase &Node) override {
+    unsigned Idx = 0;
+    for (auto I = Node.patBegin(), E = Node.patEnd(); I != E; ++I, ++Idx)
+      Node.setPattern(Idx, {fold(I->Lo), I->isRange() ? fold(I->Hi) : nullptr});
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(PrintStmt &Node) override {
+    Node.setValue(fold(Node.getValue()));
+  }
+
+  virtual void visit(FunctionCall &Node) override {
+    llvm::SmallVector<ConstValue, 4> Args;
+    bool AllKnown = true;
+    bool ArrayKnown = false;
+    llvm::SmallVector<int32_t, 8> Array;
+    unsigned Idx = 0;
+    for (auto I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I, ++Idx) {
+      Node.setArg(Idx, fold(*I));
+      if (Idx == 0 && KnownArray) {
+        ArrayKnown = true;
+        Array = ArrayValue;
+        continue;
+      }
+      AllKnown &= Known;
+      Args.push_back(Value);
+    }
+
+    Result = &Node;
+    Known = false;
+    KnownArray = false;
+    if (!AllKnown)
+      return;
+
+    ConstValue C;
+    switch (Node.getFunction()) {
+      case FunctionCall::ToInt:
+      case FunctionCall::ToFloat:
+      case FunctionCall::ToBool:
+        if (Args.size() == 1 && convertConst(Args[0], Node.getType(), C))
+          setConst(C);
+        break;
+      case FunctionCall::Abs:
+        if (Args.size() != 1)
+          break;
+        if (Args[0].Ty == DataType::Float)
+          setConst(ConstValue::getFloat(std::fabs(Args[0].Float)));
+        else
+          setConst(ConstValue::getInt(Args[0].Int < 0 ? wrap(-static_cast<int64_t>(Args[0].Int))
+                                                      : Args[0].Int));
+        break;
+      case FunctionCall::Max:
+        if (ArrayKnown && !Array.empty()) {
+          int32_t M = Array[0];
+          for (int32_t E : Array)
+            M = E > M ? E : M;
+          setConst(ConstValue::getInt(M));
+        } else if (Args.size() == 2) {
+          ConstValue A, B;
+          if (convertConst(Args[0], Node.getType(), A) &&
+              convertConst(Args[1], Node.getType(), B)) {
+            bool Greater = Node.getType() == DataType::Float ? B.Float > A.Float
+                                                             : B.Int > A.Int;
+            setConst(Greater ? B : A);
+          }
+        }
+        break;
+      case FunctionCall::Length:
+        if (ArrayKnown)
+          setConst(ConstValue::getInt(Array.size()));
+        break;
+      case FunctionCall::Index:
+        if (ArrayKnown && Args.size() == 1 && Args[0].Int >= 0 &&
+            static_cast<size_t>(Args[0].Int) < Array.size())
+          setConst(ConstValue::getInt(Array[Args[0].Int]));
+        break;
+      case FunctionCall::Find:
+        if (ArrayKnown && Args.size() == 1) {
+          int32_t Pos = -1;
+          for (size_t I = 0; I < Array.size() && Pos < 0; ++I)
+            if (Array[I] == Args[0].Int)
+              Pos = I;
+          setConst(ConstValue::getInt(Pos));
+        }
+        break;
+      case FunctionCall::Read:
+      case FunctionCall::ReadFloat:
+      case FunctionCall::ReadArray:
+        // Input is only known at run time
+        break;
+    }
+  }
+
+  virtual void visit(ArrayLiteral &Node) override {
+    llvm::SmallVector<int32_t, 8> Elements;
+    bool AllKnown = true;
+    unsigned Idx = 0;
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I, ++Idx) {
+      Node.setElement(Idx, fold(*I));
+      AllKnown &= Known;
+      Elements.push_back(Value.Int);
+    }
+
+    Result = &Node;
+    Known = false;
+    KnownArray = AllKnown;
+    ArrayValue = Elements;
+  }
+
+  virtual void visit(ArrayAccess &Node) override {
+    Node.setIndex(fold(Node.getIndex()));
+    Result = &Node;
+    Known = false;
+    KnownArray = false;
+  }
+
+  virtual void visit(ArraySlice &Node) override {
+    if (Node.getLo())
+      Node.setLo(fold(Node.getLo()));
+    if (Node.getHi())
+      Node.setHi(fold(Node.getHi()));
+    Result = &Node;
+    Known = false;
+    KnownArray = false;
+  }
+};
+// Removes statements whose effect is never observed: branches and match
+// arms that cannot run, variables that are never read, and stores that
+// are overwritten before the next read.
+class DeadCodeEliminator : public ASTVisitor {
+  using StmtList = llvm::SmallVector<AST *, 8>;
+
+  UseDef Info;
+  StmtList *Out;
+  bool Changed;
+
+  static bool isPure(AST *Node) { return !Sema::useDef(Node).SideEffects; }
+
+  // A variable can go once nothing reads it and no write to it is left.
+  bool isDead(llvm::StringRef Var) {
+    return !Info.Uses.count(Var) && !Info.Defs.count(Var);
+  }
+
+  void keep(AST *Node) { Out->push_back(Node); }
+
+  void drop() { Changed = true; }
+
+  void splice(StmtList::const_iterator I, StmtList::const_iterator E) {
+    Out->append(I, E);
+    Changed = true;
+  }
+
+  // Returns the variable S overwrites without reading it first, if any.
+  static llvm::StringRef killedVar(AST *S) {
+    if (Assignment *A = dynCast<Assignment>(S)) {
+      llvm::StringRef Var = A->getLeft()->getVal();
+      if (A->getAssignKind() == Assignment::Assign && !A->getElement() &&
+          !Sema::useDef(A->getRight()).Uses.count(Var))
+        return Var;
+    } else if (SpecialAssignment *SA = dynCast<SpecialAssignment>(S)) {
+      switch (SA->getOpKind()) {
+        case SpecialAssignment::INC:
+        case SpecialAssignment::DEC:
+        case SpecialAssignment::PLE:
+        case SpecialAssignment::MIE:
+          break;
+        default:
+          if (SA->getArg1() != SA->getDest() && SA->getArg2() != SA->getDest())
+            return SA->getDest();
+      }
+    }
+    return "";
+  }
+
+  // Drops stores that a later statement of the same list overwrites
+  // before anything reads the variable.
+  void removeOverwritten(StmtList &Stmts) {
+    StmtList Live;
+    for (unsigned I = 0, E = Stmts.size(); I != E; ++I) {
+      llvm::StringRef Var = killedVar(Stmts[I]);
+      bool Dead = false;
+      if (!Var.empty() && isPure(Stmts[I])) {
+        for (unsigned J = I + 1; J != E; ++J) {
+          UseDef Later = Sema::useDef(Stmts[J]);
+          if (Later.Uses.count(Var))
+            break;
+          if (killedVar(Stmts[J]) == Var) {
+            Dead = true;
+            break;
+          }
+          if (Later.Defs.count(Var))
+            break;
+        }
+      }
+      if (Dead)
+        drop();
+      else
+        Live.push_back(Stmts[I]);
+    }
+    Stmts = Live;
+  }
+
+  StmtList sweep(StmtList::const_iterator I, StmtList::const_iterator E) {
+    StmtList Result;
+    StmtList *Saved = Out;
+    Out = &Result;
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+    Out = Saved;
+    removeOverwritten(Result);
+    return Result;
+  }
+
+public:
+  DeadCodeEliminator(Program *Tree)
+      : Info(Sema::useDef(Tree)), Out(nullptr), Changed(false) {}
+
+  bool hasChanged() { return Changed; }
+
+  virtual void visit(Program &Node) override {
+    StmtList Body = sweep(Node.begin(), Node.end());
+    Node.setdata(llvm::SmallVector<AST *>(Body.begin(), Body.end()));
+  }
+
+  virtual void visit(Final &Node) override {}
+  virtual void visit(BinaryOp &Node) override {}
+  virtual void visit(UnaryOp &Node) override {}
+
+  virtual void visit(Assignment &Node) override {
+    if (!Info.Uses.count(Node.getLeft()->getVal()) && isPure(Node.getRight()))
+      drop();
+    else
+      keep(&Node);
+  }
+
+  virtual void visit(SpecialAssignment &Node) override {
+    if (!Info.Uses.count(Node.getDest()))
+      drop();
+    else
+      keep(&Node);
+  }
+
+  virtual void visit(Declaration &Node) override {
+    bool Dead = true;
+    for (auto I = Node.varBegin(), E = Node.varEnd(); I != E; ++I)
+      Dead &= isDead(*I);
+    for (auto I = Node.valBegin(), E = Node.valEnd(); I != E; ++I)
+      Dead &= isPure(*I);
+    if (Dead)
+      drop();
+    else
+      keep(&Node);
+  }
+
+  virtual void visit(Comparison &Node) override {}
+  virtual void visit(LogicalExpr &Node) override {}
+  virtual void visit(LogicConst &Node) override {}
+
+  virtual void visit(IfStmt &Node) override {
+    Node.setStmts(sweep(Node.begin(), Node.end()));
+    Node.setElseStmts(sweep(Node.beginElse(), Node.endElse()));
+
+    if (LogicConst *C = dynCast<LogicConst>(Node.getCond())) {
+      if (C->getValue())
+        splice(Node.begin(), Node.end());
+      else
+        splice(Node.beginElse(), Node.endElse());
+    } else if (Node.begin() == Node.end() &&
+               Node.beginElse() == Node.endElse() && isPure(Node.getCond())) {
+      drop();
+    } else {
+      keep(&Node);
+    }
+  }
+
+  virtual void visit(ForStmt &Node) override {
+    Node.setBody(sweep(Node.begin(), Node.end()));
+
+    // The condition is tested before the first iteration
+    LogicConst *C = dynCast<LogicConst>(Node.getCond());
+    if (C && !C->getValue() && (!Node.getInit() || isPure(Node.getInit())))
+      drop();
+    else
+      keep(&Node);
+  }
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.setBody(sweep(Node.begin(), Node.end()));
+    if (Node.begin() == Node.end() && isPure(Node.getArray()))
+      drop();
+    else
+      keep(&Node);
+  }
+
+  virtual void visit(MatchStmt &Node) override {
+    ConstValue Value;
+    bool KnownValue = getLiteral(Node.getValue(), Value);
+    // True while every arm so far is known not to match Value
+    bool Decided = KnownValue;
+    llvm::SmallVector<ConstValue, 8> Seen;
+    llvm::SmallVector<MatchCase *, 8> Live;
+    unsigned Total = 0;
+
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I, ++Total) {
+      MatchCase *Case = *I;
+      Case->setBody(sweep(Case->begin(), Case->end()));
+
+      bool Matches = Case->isDefault();
+      bool AllLiteral = true;
+      bool Contains = false;
+      bool Duplicate = true;
+      llvm::SmallVector<ConstValue, 2> Values;
+      for (auto P = Case->patBegin(), PE = Case->patEnd(); P != PE; ++P) {
+        ConstValue Lo, Hi;
+        if (!getLiteral(P->Lo, Lo) || (P->isRange() && !getLiteral(P->Hi, Hi))) {
+          AllLiteral = false;
+          break;
+        }
+        if (!P->isRange())
+          Hi = Lo;
+        if (KnownValue)
+          Contains |= evalCompare(Comparison::Greater_equal, Value, Lo) &&
+                      evalCompare(Comparison::Less_equal, Value, Hi);
+        // Only single values are remembered to spot repeats
+        bool Repeated = false;
+        for (ConstValue &Prev : Seen)
+          Repeated |= !P->isRange() && evalCompare(Comparison::Equal, Prev, Lo);
+        Duplicate &= Repeated;
+        if (!P->isRange())
+          Values.push_back(Lo);
+      }
+      if (!Matches && AllLiteral) {
+        // An arm repeating earlier literals, or one that cannot hold a
+        // known value, is never taken
+        if (Duplicate || (KnownValue && !Contains))
+          continue;
+        Seen.append(Values.begin(), Values.end());
+        Matches = KnownValue;
+      } else if (!Matches) {
+        Decided = false;
+      }
+
+      if (Matches && Decided) {
+        splice(Case->begin(), Case->end());
+        return;
+      }
+      Live.push_back(Case);
+      // Arms after one that always matches are unreachable
+      if (Matches) {
+        ++Total;
+        break;
+      }
+    }
+
+    if (Live.size() != Total || std::next(Node.begin(), Total) != Node.end())
+      Changed = true;
+    if (Live.empty() && isPure(Node.getValue())) {
+      drop();
+      return;
+    }
+    Node.setCases(Live);
+    keep(&Node);
+  }
+
+  virtual void visit(MatchCase &Node) override {}
+
+  virtual void visit(PrintStmt &Node) override {
+    keep(&Node);
+  }
+
+  virtual void visit(FunctionCall &Node) override {}
+  virtual void visit(ArrayLiteral &Node) override {}
+  virtual void visit(ArrayAccess &Node) override {}
+  virtual void visit(ArraySlice &Node) override {}
+};
+// One end of the values an induction variable takes: a constant, the
+// length of an array, or a loop-invariant expression, each plus Off.
+struct Bound {
+  enum Kind { Unknown, Const, Length, Limit };
+  Kind K = Unknown;
+  int64_t Off = 0;
+  llvm::StringRef Array;
+  Expr *E = nullptr;
+};
+
+bool isVar(Expr *E, llvm::StringRef Var) {
+  Final *F = dynCast<Final>(E);
+  return F && F->getKind() == Final::Ident && F->getVal() == Var;
+}
+
+bool getIntLiteral(Expr *E, int64_t &V) {
+  ConstValue C;
+  if (!getLiteral(E, C) || C.Ty != DataType::Int)
+    return false;
+  V = C.Int;
+  return true;
+}
+
+Bound parseBound(Expr *E) {
+  Bound B;
+  if (getIntLiteral(E, B.Off)) {
+    B.K = Bound::Const;
+    return B;
+  }
+
+  // length(arr), optionally plus or minus a constant
+  Expr *Base = E;
+  int64_t Off = 0;
+  BinaryOp *Op = dynCast<BinaryOp>(E);
+  if (Op && (Op->getOperator() == BinaryOp::Plus ||
+             Op->getOperator() == BinaryOp::Minus) &&
+      getIntLiteral(Op->getRight(), Off)) {
+    Base = Op->getLeft();
+    Off = Op->getOperator() == BinaryOp::Minus ? -Off : Off;
+  }
+  FunctionCall *Call = dynCast<FunctionCall>(Base);
+  if (Call && Call->getFunction() == FunctionCall::Length) {
+    Final *Arr = dynCast<Final>(*Call->argsBegin());
+    if (Arr && Arr->getKind() == Final::Ident) {
+      B.K = Bound::Length;
+      B.Array = Arr->getVal();
+      B.Off = Off;
+      return B;
+    }
+  }
+
+  // A float limit is compared as a float; truncating it for a hoisted
+  // check would let the last iterations run past the array
+  if (E->getType() != DataType::Int)
+    return B;
+  B.K = Bound::Limit;
+  B.E = E;
+  return B;
+}
+
+// Splits an index into variable plus constant; Var stays empty for a
+// constant index.
+bool parseIndex(Expr *E, llvm::StringRef &Var, int64_t &Off) {
+  Var = "";
+  Off = 0;
+  if (getIntLiteral(E, Off))
+    return true;
+  if (Final *F = dynCast<Final>(E)) {
+    if (F->getKind() != Final::Ident)
+      return false;
+    Var = F->getVal();
+    return true;
+  }
+  BinaryOp *Op = dynCast<BinaryOp>(E);
+  if (!Op)
+    return false;
+  Final *L = dynCast<Final>(Op->getLeft());
+  Final *R = dynCast<Final>(Op->getRight());
+  if (Op->getOperator() == BinaryOp::Plus && R && getIntLiteral(L, Off) &&
+      R->getKind() == Final::Ident) {
+    Var = R->getVal();
+    return true;
+  }
+  if ((Op->getOperator() == BinaryOp::Plus ||
+       Op->getOperator() == BinaryOp::Minus) &&
+      L && L->getKind() == Final::Ident && getIntLiteral(R, Off)) {
+    Var = L->getVal();
+    Off = Op->getOperator() == BinaryOp::Minus ? -Off : Off;
+    return true;
+  }
+  return false;
+}
+
+// Reads the per-iteration step of Var from a for loop increment.
+bool getStep(AST *Increment, llvm::StringRef Var, int64_t &Step) {
+  if (UnaryOp *U = dynCast<UnaryOp>(Increment)) {
+    if (!isVar(U->getOperand(), Var))
+      return false;
+    Step = U->getOperator() == UnaryOp::Inc ? 1 : -1;
+    return true;
+  }
+  Assignment *A = dynCast<Assignment>(Increment);
+  if (!A || A->getLeft()->getVal() != Var)
+    return false;
+  switch (A->getAssignKind()) {
+    case Assignment::Plus_assign:
+      return getIntLiteral(A->getRight(), Step) && Step > 0;
+    case Assignment::Minus_assign:
+      if (!getIntLiteral(A->getRight(), Step) || Step <= 0)
+        return false;
+      Step = -Step;
+      return true;
+    case Assignment::Assign: {
+      BinaryOp *Op = dynCast<BinaryOp>(A->getRight());
+      if (!Op || !isVar(Op->getLeft(), Var) ||
+          !getIntLiteral(Op->getRight(), Step) || Step <= 0)
+        return false;
+      if (Op->getOperator() == BinaryOp::Minus)
+        Step = -Step;
+      return Op->getOperator() == BinaryOp::Plus ||
+             Op->getOperator() == BinaryOp::Minus;
+    }
+    default:
+      return false;
+  }
+}
+
+// Value-range analysis over for loop induction variables. Marks array
+// accesses whose index is proven in range as unchecked, and moves the
+// check of accesses bounded by a loop-invariant limit in front of the loop.
+class BoundsCheckEliminator : public ASTVisitor {
+  struct Induction {
+    Bound Lo, Hi;
+    ForStmt *Loop;
+    llvm::StringSet<> LoopDefs;
+    int64_t Step;
+    bool UnitStep;
+    unsigned Depth; // Control-flow depth of the loop body itself
+  };
+
+  UseDef Info;
+  llvm::StringMap<int64_t> Lengths;
+  llvm::StringMap<Induction> Inductions;
+  // Grows inside code that does not run on every loop iteration
+  unsigned Depth;
+  unsigned Total, Removed, Hoisted;
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  void visitNested(llvm::SmallVector<AST *, 8>::const_iterator I,
+                   llvm::SmallVector<AST *, 8>::const_iterator E) {
+    ++Depth;
+    visitStmts(I, E);
+    --Depth;
+  }
+
+  // Whether reads of B inside a loop that writes LoopDefs see one value.
+  static bool isInvariant(const Bound &B, const llvm::StringSet<> &LoopDefs) {
+    switch (B.K) {
+      case Bound::Const:
+        return true;
+      case Bound::Length:
+        return !LoopDefs.count(B.Array);
+      case Bound::Limit: {
+        UseDef Limit = Sema::useDef(B.E);
+        if (Limit.SideEffects)
+          return false;
+        for (const auto &Use : Limit.Uses)
+          if (LoopDefs.count(Use.getKey()))
+            return false;
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+  bool getInduction(ForStmt &Node, llvm::StringRef &Var, Induction &Ind) {
+    Declaration *Init = Node.getInit();
+    if (!Init || Init->valBegin() == Init->valEnd())
+      return false;
+    Var = *Init->varBegin();
+
+    Comparison *Cond = dynCast<Comparison>(Node.getCond());
+    if (!Cond)
+      return false;
+    Comparison::Operator Op = Cond->getOperator();
+    Expr *Limit;
+    if (isVar(Cond->getLeft(), Var)) {
+      Limit = Cond->getRight();
+    } else if (isVar(Cond->getRight(), Var)) {
+      // Mirror "Limit op Var" into "Var op Limit"
+      Limit = Cond->getLeft();
+      switch (Op) {
+        case Comparison::Less:
+          Op = Comparison::Greater;
+          break;
+        case Comparison::Greater:
+          Op = Comparison::Less;
+          break;
+        case Comparison::Less_equal:
+          Op = Comparison::Greater_equal;
+          break;
+        case Comparison::Greater_equal:
+          Op = Comparison::Less_equal;
+          break;
+        default:
+          break;
+      }
+    } else {
+      return false;
+    }
+
+    int64_t Step;
+    if (!getStep(Node.getIncrement(), Var, Step))
+      return false;
+
+    // Only the increment may write the variable
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      if (Sema::useDef(*I).Defs.count(Var))
+        return false;
+
+    Ind.LoopDefs = Sema::useDef(&Node).Defs;
+    Bound Start = parseBound(*Init->valBegin());
+    Bound End = parseBound(Limit);
+    if (Start.K == Bound::Limit || !isInvariant(Start, Ind.LoopDefs) ||
+        !isInvariant(End, Ind.LoopDefs))
+      return false;
+
+    // A step past the limit must not wrap around
+    if (Step != 1 && Step != -1 &&
+        (End.K != Bound::Const || End.Off + Step > INT32_MAX ||
+         End.Off + Step < INT32_MIN))
+      return false;
+
+    if (Step > 0 && (Op == Comparison::Less || Op == Comparison::Less_equal)) {
+      Ind.Lo = Start;
+      Ind.Hi = End;
+      if (Op == Comparison::Less)
+        Ind.Hi.Off -= 1;
+    } else if (Step < 0 && (Op == Comparison::Greater ||
+                            Op == Comparison::Greater_equal)) {
+      Ind.Lo = End;
+      Ind.Hi = Start;
+      if (Op == Comparison::Greater)
+        Ind.Lo.Off += 1;
+    } else {
+      return false;
+    }
+    Ind.Loop = &Node;
+    Ind.Step = Step;
+    Ind.UnitStep = Step == 1;
+    return true;
+  }
+
+  bool getConstBound(const Bound &B, int64_t &V) {
+    if (B.K == Bound::Const) {
+      V = B.Off;
+      return true;
+    }
+    auto Len = B.K == Bound::Length ? Lengths.find(B.Array) : Lengths.end();
+    if (Len == Lengths.end())
+      return false;
+    V = Len->second + B.Off;
+    return true;
+  }
+
+  // An induction always reaches its bound, so the loop is counted; with
+  // constant ends the number of iterations is known too.
+  void recordTripCount(const Induction &Ind) {
+    int64_t Lo, Hi;
+    if (!getConstBound(Ind.Lo, Lo) || !getConstBound(Ind.Hi, Hi))
+      Ind.Loop->setCounted(-1);
+    else
+      Ind.Loop->setCounted(Hi < Lo ? 0 : (Hi - Lo) / std::abs(Ind.Step) + 1);
+  }
+
+  ArrayAccess::CheckKind classify(ArrayAccess &Node) {
+    llvm::StringRef Arr = Node.getArrayName();
+    llvm::StringRef Var;
+    int64_t Off;
+    if (!parseIndex(Node.getIndex(), Var, Off))
+      return ArrayAccess::Checked;
+
+    auto Len = Lengths.find(Arr);
+    if (Var.empty())
+      return Len != Lengths.end() && Off >= 0 && Off < Len->second
+                 ? ArrayAccess::Unchecked
+                 : ArrayAccess::Checked;
+
+    auto It = Inductions.find(Var);
+    if (It == Inductions.end())
+      return ArrayAccess::Checked;
+    Induction &Ind = It->second;
+
+    if (Ind.Lo.K != Bound::Const || Ind.Lo.Off + Off < 0)
+      return ArrayAccess::Checked;
+
+    switch (Ind.Hi.K) {
+      case Bound::Const:
+        if (Len != Lengths.end() && Ind.Hi.Off + Off < Len->second)
+          return ArrayAccess::Unchecked;
+        break;
+      case Bound::Length:
+        if (Ind.Hi.Array == Arr && Ind.Hi.Off + Off < 0)
+          return ArrayAccess::Unchecked;
+        break;
+      case Bound::Limit:
+        // The check may only move if the access runs on every iteration,
+        // so that failing it up front means the loop would have failed too.
+        // CodeGen then runs a copy of the loop that checks every access,
+        // so output and error stay those of the unhoisted loop
+        if (Ind.UnitStep && Depth == Ind.Depth && !Ind.LoopDefs.count(Arr)) {
+          Ind.Loop->addHoistedCheck({Arr, Ind.Hi.E, Ind.Hi.Off + Off + 1});
+          return ArrayAccess::Hoisted;
+        }
+        break;
+      default:
+        break;
+    }
+    return ArrayAccess::Checked;
+  }
+
+public:
+  BoundsCheckEliminator(Program *Tree)
+      : Info(Sema::useDef(Tree)), Depth(0), Total(0), Removed(0), Hoisted(0) {}
+
+  void report(llvm::raw_ostream &OS) {
+    OS << "Bounds checks: " << Total << " array accesses, " << Removed
+       << " checks removed, " << Hoisted << " hoisted out of loops\n";
+  }
+
+  virtual void visit(Program &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(Final &Node) override {}
+
+  virtual void visit(BinaryOp &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(UnaryOp &Node) override {}
+
+  virtual void visit(Assignment &Node) override {
+    if (Node.getElement())
+      Node.getElement()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(SpecialAssignment &Node) override {}
+
+  virtual void visit(Declaration &Node) override {
+    auto Val = Node.valBegin();
+    for (auto I = Node.varBegin(), E = Node.varEnd(); I != E; ++I) {
+      ArrayLiteral *Lit = nullptr;
+      if (Val != Node.valEnd()) {
+        (*Val)->accept(*this);
+        Lit = dynCast<ArrayLiteral>(*Val);
+        ++Val;
+      }
+      // Only arrays that are never reassigned keep their literal length
+      if (Lit && !Info.Defs.count(*I))
+        Lengths[*I] = Lit->size();
+      else
+        Lengths.erase(*I);
+    }
+  }
+
+  virtual void visit(Comparison &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(LogicalExpr &Node) override {
+    Node.getLeft()->accept(*this);
+    ++Depth;
+    Node.getRight()->accept(*this);
+    --Depth;
+  }
+
+  virtual void visit(LogicConst &Node) override {}
+
+  virtual void visit(IfStmt &Node) override {
+    Node.getCond()->accept(*this);
+    visitNested(Node.begin(), Node.end());
+    visitNested(Node.beginElse(), Node.endElse());
+  }
+
+  virtual void visit(ForStmt &Node) override {
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    if (Node.getCond())
+      Node.getCond()->accept(*this);
+
+    llvm::StringRef Var;
+    Induction Ind;
+    bool HasInduction = getInduction(Node, Var, Ind);
+    ++Depth;
+    if (HasInduction) {
+      recordTripCount(Ind);
+      Ind.Depth = Depth;
+      Inductions[Var] = Ind;
+    }
+    visitStmts(Node.begin(), Node.end());
+    if (Node.getIncrement())
+      Node.getIncrement()->accept(*this);
+    if (HasInduction)
+      Inductions.erase(Var);
+    --Depth;
+  }
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.getArray()->accept(*this);
+    visitNested(Node.begin(), Node.end());
+  }
+
+  virtual void visit(MatchStmt &Node) override {
+    Node.getValue()->accept(*this);
+    ++Depth;
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+    --Depth;
+  }
+
+  virtual void visit(MatchCase &Node) override {
+    for (auto I = Node.patBegin(), E = Node.patEnd(); I != E; ++I) {
+      I->Lo->accept(*this);
+      if (I->isRange())
+        I->Hi->accept(*this);
+    }
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(PrintStmt &Node) override {
+    Node.getValue()->accept(*this);
+  }
+
+  virtual void visit(FunctionCall &Node) override {
+    for (auto I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(ArrayLiteral &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(ArrayAccess &Node) override {
+    Node.getIndex()->accept(*this);
+    Node.setCheck(classify(Node));
+    ++Total;
+    if (Node.getCheck() == ArrayAccess::Unchecked)
+      ++Removed;
+    else if (Node.getCheck() == ArrayAccess::Hoisted)
+      ++Hoisted;
+  }
+
+  virtual void visit(ArraySlice &Node) override {
+    if (Node.getLo())
+      Node.getLo()->accept(*this);
+    if (Node.getHi())
+      Node.getHi()->accept(*this);
+  }
+};
+
+// Marks the array literals whose buffer no element store can reach, so
+// CodeGen may use a constant literal in place. Copying or slicing an array
+// variable shares its buffer, so a store through any copy counts.
+class ReadOnlyArrays : public ASTVisitor {
+  llvm::StringSet<> Stored;
+  llvm::SmallVector<std::pair<llvm::StringRef, llvm::StringRef>, 8> Copies;
+  bool Marking;
+
+  // Var now names the buffer Value evaluates to.
+  void bind(llvm::StringRef Var, Expr *Value) {
+    if (!Marking) {
+      Final *F = dynCast<Final>(Value);
+      if (F && F->getKind() == Final::Ident && F->getType() == DataType::Array)
+        Copies.push_back({Var, F->getVal()});
+      else if (ArraySlice *View = dynCast<ArraySlice>(Value))
+        Copies.push_back({Var, View->getArrayName()});
+      return;
+    }
+    if (ArrayLiteral *Lit = dynCast<ArrayLiteral>(Value))
+      Lit->setReadOnly(!Stored.count(Var));
+  }
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+public:
+  void run(Program *Tree) {
+    Marking = false;
+    Tree->accept(*this);
+
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+      for (auto &Copy : Copies) {
+        if (Stored.count(Copy.first) == Stored.count(Copy.second))
+          continue;
+        Stored.insert(Copy.first);
+        Stored.insert(Copy.second);
+        Changed = true;
+      }
+    }
+
+    Marking = true;
+    Tree->accept(*this);
+  }
+
+  virtual void visit(Program &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(Final &Node) override {}
+
+  virtual void visit(BinaryOp &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(UnaryOp &Node) override {}
+
+  virtual void visit(Assignment &Node) override {
+    Node.getRight()->accept(*this);
+    if (ArrayAccess *Element = Node.getElement()) {
+      Element->accept(*this);
+      Stored.insert(Node.getLeft()->getVal());
+    } else if (Node.getAssignKind() == Assignment::Assign) {
+      bind(Node.getLeft()->getVal(), Node.getRight());
+    }
+  }
+
+  virtual void visit(SpecialAssignment &Node) override {}
+
+  virtual void visit(Declaration &Node) override {
+    auto Val = Node.valBegin();
+    for (auto I = Node.varBegin(), E = Node.varEnd();
+         I != E && Val != Node.valEnd(); ++I, ++Val) {
+      (*Val)->accept(*this);
+      bind(*I, *Val);
+    }
+  }
+
+  virtual void visit(Comparison &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(LogicalExpr &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(LogicConst &Node) override {}
+
+  virtual void visit(IfStmt &Node) override {
+    Node.getCond()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+    visitStmts(Node.beginElse(), Node.endElse());
+  }
+
+  virtual void visit(ForStmt &Node) override {
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    if (Node.getCond())
+      Node.getCond()->accept(*this);
+    if (Node.getIncrement())
+      Node.getIncrement()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.getArray()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(MatchStmt &Node) override {
+    Node.getValue()->accept(*this);
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(MatchCase &Node) override {
+    for (auto I = Node.patBegin(), E = Node.patEnd(); I != E; ++I) {
+      I->Lo->accept(*this);
+      if (I->isRange())
+        I->Hi->accept(*this);
+    }
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(PrintStmt &Node) override {
+    Node.getValue()->accept(*this);
+  }
+
+  virtual void visit(FunctionCall &Node) override {
+    for (auto I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(ArrayLiteral &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+    // Literals not bound to a variable are only read
+    if (Marking)
+      Node.setReadOnly(true);
+  }
+
+  virtual void visit(ArrayAccess &Node) override {
+    Node.getIndex()->accept(*this);
+  }
+
+  virtual void visit(ArraySlice &Node) override {
+    if (Node.getLo())
+      Node.getLo()->accept(*this);
+    if (Node.getHi())
+      Node.getHi()->accept(*this);
+  }
+};
+
+// Decides where array literals live and which loops release their arrays
+// every iteration. An array survives an iteration only by being assigned
+// to a variable declared outside the loop body; element stores and reads
+// never keep one. A small literal whose innermost loop keeps no array, or
+// that is in no loop at all, is dead before it is evaluated again, so one
+// entry-block buffer can hold it. Other arrays come from the heap region,
+// which loops keeping none of them reset after each iteration.
+class RegionScopes : public ASTVisitor {
+  struct Loop {
+    llvm::StringSet<> Declared; // Arrays declared in the body
+    llvm::SmallVector<ArrayLiteral *, 4> Literals; // Stack candidates
+    bool Allocates = false; // Takes memory from the heap region
+    bool Escapes = false;
+  };
+  llvm::SmallVector<Loop, 4> Loops;
+
+  // Largest literal, and all literals together, kept on the stack
+  static const unsigned MaxStackElements = 256;
+  static const unsigned MaxStackTotal = 16384;
+  unsigned StackElements = 0;
+
+  bool placeOnStack(ArrayLiteral &Lit) {
+    if (StackElements + Lit.size() > MaxStackTotal)
+      return false;
+    StackElements += Lit.size();
+    Lit.setOnStack(true);
+    return true;
+  }
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  // Closes the innermost loop and reports whether it should release its
+  // heap arrays after each iteration.
+  bool leaveLoop() {
+    Loop Body = Loops.pop_back_val();
+    for (ArrayLiteral *Lit : Body.Literals)
+      if (Body.Escapes || !placeOnStack(*Lit))
+        Body.Allocates = true;
+    // An enclosing loop runs whatever this body allocates
+    if (Body.Allocates && !Loops.empty())
+      Loops.back().Allocates = true;
+    return Body.Allocates && !Body.Escapes;
+  }
+
+  void allocate() {
+    if (!Loops.empty())
+      Loops.back().Allocates = true;
+  }
+
+  // Storing into Var keeps the array alive in every loop Var is declared
+  // outside of.
+  void store(llvm::StringRef Var) {
+    for (auto I = Loops.rbegin(), E = Loops.rend(); I != E; ++I) {
+      if (I->Declared.count(Var))
+        return;
+      I->Escapes = true;
+    }
+  }
+
+public:
+  virtual void visit(Program &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(Final &Node) override {}
+
+  virtual void visit(BinaryOp &Node) override {
+    // The result of element-wise arithmetic is a new heap array
+    if (Node.getType() == DataType::Array)
+      allocate();
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(UnaryOp &Node) override {}
+
+  virtual void visit(Assignment &Node) override {
+    Node.getRight()->accept(*this);
+    if (ArrayAccess *Element = Node.getElement())
+      Element->accept(*this);
+    else if (Node.getLeft()->getType() == DataType::Array)
+      store(Node.getLeft()->getVal());
+  }
+
+  virtual void visit(SpecialAssignment &Node) override {}
+
+  virtual void visit(Declaration &Node) override {
+    for (auto I = Node.valBegin(), E = Node.valEnd(); I != E; ++I)
+      (*I)->accept(*this);
+    if (Node.getType() == DataType::Array && !Loops.empty())
+      for (auto I = Node.varBegin(), E = Node.varEnd(); I != E; ++I)
+        Loops.back().Declared.insert(*I);
+  }
+
+  virtual void visit(Comparison &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(LogicalExpr &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(LogicConst &Node) override {}
+
+  virtual void visit(IfStmt &Node) override {
+    Node.getCond()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+    visitStmts(Node.beginElse(), Node.endElse());
+  }
+
+  virtual void visit(ForStmt &Node) override {
+    // The init runs once; the condition and increment run every iteration
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    Loops.emplace_back();
+    if (Node.getCond())
+      Node.getCond()->accept(*this);
+    if (Node.getIncrement())
+      Node.getIncrement()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+    Node.setReleasesArrays(leaveLoop());
+  }
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.getArray()->accept(*this);
+    Loops.emplace_back();
+    visitStmts(Node.begin(), Node.end());
+    Node.setReleasesArrays(leaveLoop());
+  }
+
+  virtual void visit(MatchStmt &Node) override {
+    Node.getValue()->accept(*this);
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(MatchCase &Node) override {
+    for (auto I = Node.patBegin(), E = Node.patEnd(); I != E; ++I) {
+      I->Lo->accept(*this);
+      if (I->isRange())
+        I->Hi->accept(*this);
+    }
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(PrintStmt &Node) override {
+    Node.getValue()->accept(*this);
+  }
+
+  virtual void visit(FunctionCall &Node) override {
+    for (auto I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I)
+      (*I)->accept(*this);
+    if (Node.getFunction() == FunctionCall::ReadArray)
+      allocate();
+  }
+
+  virtual void visit(ArrayLiteral &Node) override {
+    bool Constant = true;
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I) {
+      (*I)->accept(*this);
+      Final *F = dynCast<Final>(*I);
+      Constant &= F && F->getKind() == Final::Number;
+    }
+    // Read-only constant literals are used in place as globals
+    if ((Constant && Node.isReadOnly()) || Node.size() == 0)
+      return;
+    if (Node.size() > MaxStackElements)
+      allocate();
+    else if (!Loops.empty())
+      Loops.back().Literals.push_back(&Node);
+    else
+      placeOnStack(Node);
+  }
+
+  virtual void visit(ArrayAccess &Node) override {
+    Node.getIndex()->accept(*this);
+  }
+
+  // A slice points into its parent's buffer and allocates nothing
+  virtual void visit(ArraySlice &Node) override {
+    if (Node.getLo())
+      Node.getLo()->accept(*this);
+    if (Node.getHi())
+      Node.getHi()->accept(*this);
+  }
+};
+
+// Walks the body of a candidate loop and collects the variables it only
+// combines into with one associative operator. Anything else the body does
+// to a variable declared outside it, and any output or input, makes the
+// iterations depend on each other.
+class ReductionFinder : public ASTVisitor {
+  const llvm::StringSet<> &Known;
+  llvm::StringSet<> Locals;
+  llvm::StringSet<> Reads;
+  llvm::StringSet<> Stored; // Arrays the body stores elements into
+  llvm::StringMap<Reduction::OpKind> Candidates;
+  llvm::SmallVector<llvm::StringRef, 4> Order;
+  bool Valid = true;
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  void write(llvm::StringRef Var) {
+    if (!Locals.count(Var))
+      Valid = false;
+  }
+
+  void combine(llvm::StringRef Var, Reduction::OpKind Op) {
+    if (Locals.count(Var))
+      return;
+    auto Ins = Candidates.insert({Var, Op});
+    if (Ins.second)
+      Order.push_back(Var);
+    else if (Ins.first->second != Op)
+      Valid = false;
+  }
+
+  bool aliasesOuter(Expr *Value) {
+    if (ArraySlice *View = dynCast<ArraySlice>(Value))
+      return !Locals.count(View->getArrayName());
+    Final *F = dynCast<Final>(Value);
+    return F && F->getKind() == Final::Ident &&
+           F->getType() == DataType::Array && !Locals.count(F->getVal());
+  }
+
+  // Var op= e, Var = Var op e, Var = e op Var and Var = max(Var, e), with
+  // Other set to e.
+  static bool matchReduction(Assignment &Node, Reduction::OpKind &Op, Expr *&Other) {
+    llvm::StringRef Var = Node.getLeft()->getVal();
+    Other = Node.getRight();
+    switch (Node.getAssignKind()) {
+      case Assignment::Plus_assign:
+      case Assignment::Minus_assign:
+        Op = Reduction::Add;
+        return true;
+      case Assignment::Star_assign:
+        Op = Reduction::Mul;
+        return true;
+      case Assignment::Assign:
+        break;
+      default:
+        return false;
+    }
+
+    Expr *L, *R;
+    if (BinaryOp *B = dynCast<BinaryOp>(Node.getRight())) {
+      L = B->getLeft();
+      R = B->getRight();
+      switch (B->getOperator()) {
+        case BinaryOp::Plus:
+          Op = Reduction::Add;
+          break;
+        case BinaryOp::Minus:
+          // Only Var - e; e - Var flips the sign every iteration
+          Op = Reduction::Add;
+          Other = R;
+          return isVar(L, Var);
+        case BinaryOp::Mul:
+          Op = Reduction::Mul;
+          break;
+        default:
+          return false;
+      }
+    } else if (FunctionCall *Call = dynCast<FunctionCall>(Node.getRight())) {
+      if (Call->getFunction() != FunctionCall::Max || Call->argsEnd() - Call->argsBegin() != 2)
+        return false;
+      L = Call->argsBegin()[0];
+      R = Call->argsBegin()[1];
+      Op = Reduction::Max;
+    } else {
+      return false;
+    }
+    if (isVar(L, Var)) {
+      Other = R;
+      return true;
+    }
+    if (isVar(R, Var)) {
+      Other = L;
+      return true;
+    }
+    return false;
+  }
+
+public:
+  ReductionFinder(const llvm::StringSet<> &Known, llvm::StringRef Induction) : Known(Known) {
+    Locals.insert(Induction);
+  }
+
+  // The reductions of a loop whose iterations are otherwise independent.
+  bool getReductions(llvm::SmallVector<Reduction, 4> &Out) {
+    if (!Valid)
+      return false;
+    // Stores through a local that came to alias an outer array
+    for (const auto &Var : Stored)
+      if (!Locals.count(Var.getKey()))
+        return false;
+    for (llvm::StringRef Var : Order) {
+      // Reading one mid-loop would see a partial result
+      if (Reads.count(Var))
+        return false;
+      Out.push_back({Var, Candidates[Var]});
+    }
+    return true;
+  }
+
+  virtual void visit(Program &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(Final &Node) override {
+    if (Node.getKind() == Final::Ident)
+      Reads.insert(Node.getVal());
+  }
+
+  virtual void visit(BinaryOp &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(UnaryOp &Node) override {
+    Node.getOperand()->accept(*this);
+    write(static_cast<Final *>(Node.getOperand())->getVal());
+  }
+
+  virtual void visit(Assignment &Node) override {
+    llvm::StringRef Var = Node.getLeft()->getVal();
+    if (ArrayAccess *Element = Node.getElement()) {
+      // Another iteration may read the element, possibly through an alias
+      write(Var);
+      Stored.insert(Var);
+      Element->getIndex()->accept(*this);
+      Node.getRight()->accept(*this);
+      return;
+    }
+
+    // Partial results are kept and combined as scalars only; a = a + b on
+    // arrays builds a new array every iteration
+    DataType Ty = Node.getLeft()->getType();
+    Reduction::OpKind Op;
+    Expr *Other;
+    if (!Locals.count(Var) && (Ty == DataType::Int || Ty == DataType::Float) &&
+        matchReduction(Node, Op, Other)) {
+      combine(Var, Op);
+      Other->accept(*this);
+      return;
+    }
+    if (Node.getAssignKind() != Assignment::Assign)
+      Reads.insert(Var);
+    write(Var);
+    if (aliasesOuter(Node.getRight()))
+      Locals.erase(Var);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(SpecialAssignment &Node) override {
+    llvm::StringRef Var = Node.getDest();
+    llvm::StringRef Arg1 = Node.getArg1(), Arg2 = Node.getArg2();
+    if (!Locals.count(Var)) {
+      switch (Node.getOpKind()) {
+        case SpecialAssignment::INC:
+        case SpecialAssignment::DEC:
+          combine(Var, Reduction::Add);
+          return;
+        case SpecialAssignment::PLE:
+        case SpecialAssignment::MIE:
+          combine(Var, Reduction::Add);
+          Reads.insert(Arg1);
+          return;
+        case SpecialAssignment::ADD:
+        case SpecialAssignment::MUL:
+          if (Arg1 == Var || Arg2 == Var) {
+            combine(Var, Node.getOpKind() == SpecialAssignment::ADD ? Reduction::Add
+                                                                    : Reduction::Mul);
+            Reads.insert(Arg1 == Var ? Arg2 : Arg1);
+            return;
+          }
+          break;
+        case SpecialAssignment::SUB:
+          if (Arg1 == Var) {
+            combine(Var, Reduction::Add);
+            Reads.insert(Arg2);
+            return;
+          }
+          break;
+        default:
+          break;
+      }
+      Valid = false;
+      return;
+    }
+    if (!Arg1.empty())
+      Reads.insert(Arg1);
+    if (!Arg2.empty())
+      Reads.insert(Arg2);
+  }
+
+  virtual void visit(Declaration &Node) override {
+    for (auto I = Node.valBegin(), E = Node.valEnd(); I != E; ++I)
+      (*I)->accept(*this);
+    auto Val = Node.valBegin();
+    for (auto I = Node.varBegin(), E = Node.varEnd(); I != E; ++I) {
+      // A copy or slice of an outer array stores into the outer buffer
+      if (Val == Node.valEnd() || !aliasesOuter(*Val++))
+        Locals.insert(*I);
+    }
+  }
+
+  virtual void visit(Comparison &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(LogicalExpr &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  }
+
+  virtual void visit(LogicConst &Node) override {}
+
+  virtual void visit(IfStmt &Node) override {
+    Node.getCond()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+    visitStmts(Node.beginElse(), Node.endElse());
+  }
+
+  virtual void visit(ForStmt &Node) override {
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    if (Node.getCond())
+      Node.getCond()->accept(*this);
+    if (Node.getIncrement())
+      Node.getIncrement()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.getArray()->accept(*this);
+    // A name declared nowhere else is the loop's own
+    if (!Known.count(Node.getVar()))
+      Locals.insert(Node.getVar());
+    write(Node.getVar());
+    for (auto I = Node.reductionsBegin(), E = Node.reductionsEnd(); I != E; ++I)
+      combine(*I, Reduction::Add);
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(MatchStmt &Node) override {
+    Node.getValue()->accept(*this);
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(MatchCase &Node) override {
+    for (auto I = Node.patBegin(), E = Node.patEnd(); I != E; ++I) {
+      I->Lo->accept(*this);
+      if (I->isRange())
+        I->Hi->accept(*this);
+    }
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(PrintStmt &Node) override { Valid = false; }
+
+  virtual void visit(FunctionCall &Node) override {
+    switch (Node.getFunction()) {
+      case FunctionCall::Read:
+      case FunctionCall::ReadFloat:
+      case FunctionCall::ReadArray:
+        Valid = false;
+        return;
+      default:
+        break;
+    }
+    for (auto I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(ArrayLiteral &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(ArrayAccess &Node) override {
+    Reads.insert(Node.getArrayName());
+    Node.getIndex()->accept(*this);
+  }
+
+  virtual void visit(ArraySlice &Node) override {
+    Reads.insert(Node.getArrayName());
+    if (Node.getLo())
+      Node.getLo()->accept(*this);
+    if (Node.getHi())
+      Node.getHi()->accept(*this);
+  }
+};
+
+// Marks counted loops "for (int i = lo; i < hi; i++)" whose iterations
+// share nothing but reductions as parallel. Loops already inside a
+// parallel body are left alone, since the runtime would run them on one
+// thread anyway.
+class LoopParallelizer : public ASTVisitor {
+  // Fewer iterations than this do not pay for waking the threads
+  static const int64_t MinTrips = 16384;
+  // Every name declared so far, for ReductionFinder
+  llvm::StringSet<> Known;
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  bool parallelize(ForStmt &Node) {
+    if (!Node.isCounted() || (Node.getTripCount() >= 0 && Node.getTripCount() < MinTrips))
+      return false;
+    Declaration *Init = Node.getInit();
+    Comparison *Cond = dynCast<Comparison>(Node.getCond());
+    if (!Init || !Cond || Init->varEnd() - Init->varBegin() != 1)
+      return false;
+    llvm::StringRef Var = *Init->varBegin();
+    int64_t Step;
+    if (!isVar(Cond->getLeft(), Var) || Cond->getRight()->getType() != DataType::Int ||
+        (Cond->getOperator() != Comparison::Less &&
+         Cond->getOperator() != Comparison::Less_equal) ||
+        !getStep(Node.getIncrement(), Var, Step) || Step != 1)
+      return false;
+
+    ReductionFinder Finder(Known, Var);
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(Finder);
+    llvm::SmallVector<Reduction, 4> Reductions;
+    if (!Finder.getReductions(Reductions))
+      return false;
+    Node.setParallel(Reductions);
+    return true;
+  }
+
+public:
+  virtual void visit(Program &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(Final &Node) override {}
+  virtual void visit(BinaryOp &Node) override {}
+  virtual void visit(UnaryOp &Node) override {}
+  virtual void visit(Assignment &Node) override {}
+  virtual void visit(SpecialAssignment &Node) override {}
+
+  virtual void visit(Declaration &Node) override {
+    for (auto I = Node.varBegin(), E = Node.varEnd(); I != E; ++I)
+      Known.insert(*I);
+  }
+
+  virtual void visit(Comparison &Node) override {}
+  virtual void visit(LogicalExpr &Node) override {}
+  virtual void visit(LogicConst &Node) override {}
+
+  virtual void visit(IfStmt &Node) override {
+    visitStmts(Node.begin(), Node.end());
+    visitStmts(Node.beginElse(), Node.endElse());
+  }
+
+  virtual void visit(ForStmt &Node) override {
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    if (!parallelize(Node))
+      visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(ForeachStmt &Node) override {
+    if (!Node.isParallel())
+      visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(MatchStmt &Node) override {
+    for (auto I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  virtual void visit(MatchCase &Node) override {
+    visitStmts(Node.begin(), Node.end());
+  }
+
+  virtual void visit(PrintStmt &Node) override {}
+  virtual void visit(FunctionCall &Node) override {}
+  virtual void visit(ArrayLiteral &Node) override {}
+  virtual void visit(ArrayAccess &Node) override {}
+  virtual void visit(ArraySlice &Node) override {}
+};
+}
+
+void Optimizer::optimize(Program *Tree) {
+  ConstantFolder Folder(Tree);
+  Tree->accept(Folder);
+
+  // Removing a statement can leave the variables it read unused, so sweep
+  // until nothing changes
+  for (unsigned Round = 0; Round < 8; ++Round) {
+    DeadCodeEliminator Eliminator(Tree);
+    Tree->accept(Eliminator);
+    if (!Eliminator.hasChanged())
+      break;
+  }
+
+  BoundsCheckEliminator Bounds(Tree);
+  Tree->accept(Bounds);
+  if (ReportBounds)
+    Bounds.report(llvm::errs());
+
+  ReadOnlyArrays Arrays;
+  Arrays.run(Tree);
+
+  RegionScopes Regions;
+  Tree->accept(Regions);
+
+  if (AutoParallel) {
+    LoopParallelizer Parallelizer;
+    Tree->accept(Parallelizer);
+  }
+}
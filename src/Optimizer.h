@@ -0,0 +1,19 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "AST.h"
+
+class Optimizer
+{
+ bool ReportBounds;
+ bool AutoParallel;
+
+public:
+ Optimizer(bool ReportBounds = false, bool AutoParallel = false)
+     : ReportBounds(ReportBounds), AutoParallel(AutoParallel) {}
+
+ // Simplifies a type-checked tree in place before code generation.
+ void optimize(Program *Tree);
+
+};
+#endif
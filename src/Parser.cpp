@@ -54,8 +54,8 @@ AST *Parser::parseStatement()
     {
         return parseFor();
     }
-    // Foreach loop
-    else if (Tok.is(Token::KW_foreach))
+    // Foreach loop, optionally parallel
+    else if (Tok.isOneOf(Token::KW_foreach, Token::KW_parallel))
     {
         return parseForeach();
     }
@@ -188,6 +188,19 @@ Assignment *Parser::parseAssign()
     Final *F = new Final(Final::Ident, Tok.getText());
     advance();
 
+    // Element store: arr[index] = value;
+    ArrayAccess *Element = nullptr;
+    if (Tok.is(Token::l_bracket))
+    {
+        advance();
+        Expr *index = parseExpr();
+        if (!index)
+            return nullptr;
+        if (consume(Token::r_bracket))
+            return nullptr;
+        Element = new ArrayAccess(F->getVal(), index);
+    }
+
     Assignment::AssignKind AK;
 
     if (Tok.is(Token::assign))
@@ -215,7 +228,7 @@ Assignment *Parser::parseAssign()
     if (!E)
         return nullptr;
 
-    return new Assignment(F, E, AK);
+    return new Assignment(F, E, AK, Element);
 }
 
 SpecialAssignment *Parser::parseSpecialAssign()
@@ -466,6 +479,10 @@ ForStmt *Parser::parseFor()
 
 ForeachStmt *Parser::parseForeach()
 {
+    bool parallel = Tok.is(Token::KW_parallel);
+    if (parallel)
+        advance();
+
     if (consume(Token::KW_foreach))
         return nullptr;
 
@@ -485,18 +502,38 @@ ForeachStmt *Parser::parseForeach()
     if (consume(Token::KW_in))
         return nullptr;
 
-    // Parse array name
-    if (!Tok.is(Token::ident))
-    {
-        error();
+    // Parse the array, a name or any array-valued expression such as a slice
+    Expr *array = parseExpr();
+    if (!array)
         return nullptr;
-    }
-    llvm::StringRef array = Tok.getText();
-    advance();
 
     if (consume(Token::r_paren))
         return nullptr;
 
+    // Parse 'reduce(a, b)', the shared sums of a parallel loop
+    llvm::SmallVector<llvm::StringRef, 4> reductions;
+    if (parallel && Tok.is(Token::KW_reduce))
+    {
+        advance();
+        if (consume(Token::l_paren))
+            return nullptr;
+        while (true)
+        {
+            if (!Tok.is(Token::ident))
+            {
+                error();
+                return nullptr;
+            }
+            reductions.push_back(Tok.getText());
+            advance();
+            if (!Tok.is(Token::comma))
+                break;
+            advance();
+        }
+        if (consume(Token::r_paren))
+            return nullptr;
+    }
+
     // Parse body
     if (consume(Token::l_brace))
         return nullptr;
@@ -513,7 +550,7 @@ ForeachStmt *Parser::parseForeach()
     if (consume(Token::r_brace))
         return nullptr;
 
-    return new ForeachStmt(var, array, body);
+    return new ForeachStmt(var, array, body, parallel, reductions);
 }
 
 MatchStmt *Parser::parseMatch()
@@ -533,19 +570,35 @@ MatchStmt *Parser::parseMatch()
     llvm::SmallVector<MatchCase *, 8> cases;
     while (!Tok.is(Token::r_brace) && !Tok.is(Token::eoi))
     {
-        Expr *pattern = nullptr;
+        llvm::SmallVector<MatchPattern, 2> patterns;
 
         // Check for default case (_)
         if (Tok.is(Token::ident) && Tok.getText() == "_")
         {
             advance();
-            pattern = nullptr; // Default case
         }
         else
         {
-            pattern = parseExpr();
-            if (!pattern)
-                return nullptr;
+            // Alternatives: value, or lo..hi, separated by |
+            while (true)
+            {
+                Expr *lo = parseExpr();
+                if (!lo)
+                    return nullptr;
+                Expr *hi = nullptr;
+                if (Tok.is(Token::dotdot))
+                {
+                    advance();
+                    hi = parseExpr();
+                    if (!hi)
+                        return nullptr;
+                }
+                patterns.push_back({lo, hi});
+
+                if (!Tok.is(Token::pipe))
+                    break;
+                advance();
+            }
         }
 
         // Parse ->
@@ -559,7 +612,7 @@ MatchStmt *Parser::parseMatch()
             return nullptr;
         caseBody.push_back(stmt);
 
-        cases.push_back(new MatchCase(pattern, caseBody));
+        cases.push_back(new MatchCase(patterns, caseBody));
 
         // Optionally consume comma
         if (Tok.is(Token::comma))
@@ -684,7 +737,8 @@ Expr *Parser::parsePrimary()
     // Function calls
     if (Tok.isOneOf(Token::KW_to_int, Token::KW_to_float, Token::KW_to_bool,
                     Token::KW_abs, Token::KW_length, Token::KW_max,
-                    Token::KW_index, Token::KW_find))
+                    Token::KW_index, Token::KW_find, Token::KW_read,
+                    Token::KW_read_float, Token::KW_read_array))
     {
         return parseFunctionCall();
     }
@@ -717,16 +771,37 @@ Expr *Parser::parseFinal()
         llvm::StringRef name = Tok.getText();
         advance();
 
-        // Check for array access
+        // Check for array access or a slice name[lo:hi]
         if (Tok.is(Token::l_bracket))
         {
             advance();
-            Expr *index = parseExpr();
-            if (!index)
-                return nullptr;
-            if (consume(Token::r_bracket))
-                return nullptr;
-            Res = new ArrayAccess(name, index);
+            Expr *index = nullptr;
+            if (!Tok.is(Token::colon))
+            {
+                index = parseExpr();
+                if (!index)
+                    return nullptr;
+            }
+            if (Tok.is(Token::colon))
+            {
+                advance();
+                Expr *hi = nullptr;
+                if (!Tok.is(Token::r_bracket))
+                {
+                    hi = parseExpr();
+                    if (!hi)
+                        return nullptr;
+                }
+                if (consume(Token::r_bracket))
+                    return nullptr;
+                Res = new ArraySlice(name, index, hi);
+            }
+            else
+            {
+                if (consume(Token::r_bracket))
+                    return nullptr;
+                Res = new ArrayAccess(name, index);
+            }
         }
         else
         {
@@ -833,6 +908,12 @@ FunctionCall *Parser::parseFunctionCall()
         func = FunctionCall::Index;
     else if (Tok.is(Token::KW_find))
         func = FunctionCall::Find;
+    else if (Tok.is(Token::KW_read))
+        func = FunctionCall::Read;
+    else if (Tok.is(Token::KW_read_float))
+        func = FunctionCall::ReadFloat;
+    else if (Tok.is(Token::KW_read_array))
+        func = FunctionCall::ReadArray;
     else
     {
         error();
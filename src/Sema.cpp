@@ -1,10 +1,15 @@
 #include "Sema.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 
 namespace nms {
 class InputCheck : public ASTVisitor {
   llvm::StringSet<> Scope;
+  // Names in Scope in declaration order, so a block can drop its own
+  llvm::SmallVector<llvm::StringRef, 16> Declared;
   bool HasError;
 
   enum ErrorType { Twice, Not };
@@ -16,6 +21,29 @@ class InputCheck : public ASTVisitor {
     HasError = true;
   }
 
+  void declare(llvm::StringRef V) {
+    if (!Scope.insert(V).second)
+      error(Twice, V);
+    else
+      Declared.push_back(V);
+  }
+
+  size_t enterBlock() { return Declared.size(); }
+
+  // Names declared inside a block are not visible after it.
+  void leaveBlock(size_t Mark) {
+    while (Declared.size() > Mark)
+      Scope.erase(Declared.pop_back_val());
+  }
+
+  void visitBlock(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    size_t Mark = enterBlock();
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+    leaveBlock(Mark);
+  }
+
 public:
   InputCheck() : HasError(false) {}
 
@@ -49,7 +77,9 @@ public:
 
   virtual void visit(Assignment &Node) override {
     Final *dest = Node.getLeft();
-    if (dest)
+    if (Node.getElement())
+      Node.getElement()->accept(*this);
+    else if (dest)
       dest->accept(*this);
 
     Expr *Right = Node.getRight();
@@ -71,8 +101,7 @@ public:
 
   virtual void visit(Declaration &Node) override {
     for (llvm::SmallVector<llvm::StringRef, 8>::const_iterator I = Node.varBegin(), E = Node.varEnd(); I != E; ++I) {
-      if (!Scope.insert(*I).second)
-        error(Twice, *I);
+      declare(*I);
     }
     for (llvm::SmallVector<Expr *, 8>::const_iterator I = Node.valBegin(), E = Node.valEnd(); I != E; ++I){
       (*I)->accept(*this);
@@ -93,6 +122,284 @@ public:
       Node.getRight()->accept(*this);
   };
 
+  virtual void visit(LogicConst &Node) override {};
+
+  virtual void visit(IfStmt &Node) override {
+    if (Node.getCond())
+      Node.getCond()->accept(*this);
+
+    visitBlock(Node.begin(), Node.end());
+    visitBlock(Node.beginElse(), Node.endElse());
+  };
+
+  virtual void visit(ForStmt &Node) override {
+    // The loop variable is scoped to the loop
+    size_t Mark = enterBlock();
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    if (Node.getCond())
+      Node.getCond()->accept(*this);
+    if (Node.getIncrement())
+      Node.getIncrement()->accept(*this);
+
+    visitBlock(Node.begin(), Node.end());
+    leaveBlock(Mark);
+  };
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.getArray()->accept(*this);
+    for (llvm::SmallVector<llvm::StringRef, 4>::const_iterator I = Node.reductionsBegin(), E = Node.reductionsEnd(); I != E; ++I) {
+      if (Scope.find(*I) == Scope.end())
+        error(Not, *I);
+    }
+
+    // Add loop variable to scope temporarily
+    size_t Mark = enterBlock();
+    if (Scope.insert(Node.getVar()).second)
+      Declared.push_back(Node.getVar());
+
+    visitBlock(Node.begin(), Node.end());
+    leaveBlock(Mark);
+  };
+
+  virtual void visit(MatchStmt &Node) override {
+    if (Node.getValue())
+      Node.getValue()->accept(*this);
+
+    for (llvm::SmallVector<MatchCase *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I) {
+      (*I)->accept(*this);
+    }
+  };
+
+  virtual void visit(MatchCase &Node) override {
+    for (llvm::SmallVector<MatchPattern, 2>::const_iterator I = Node.patBegin(), E = Node.patEnd(); I != E; ++I) {
+      I->Lo->accept(*this);
+      if (I->isRange())
+        I->Hi->accept(*this);
+    }
+
+    visitBlock(Node.begin(), Node.end());
+  };
+
+  virtual void visit(PrintStmt &Node) override {
+    if (Node.getValue())
+      Node.getValue()->accept(*this);
+  };
+
+  virtual void visit(FunctionCall &Node) override {
+    for (llvm::SmallVector<Expr *, 4>::const_iterator I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I) {
+      (*I)->accept(*this);
+    }
+  };
+
+  virtual void visit(ArrayLiteral &Node) override {
+    for (llvm::SmallVector<Expr *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I) {
+      (*I)->accept(*this);
+    }
+  };
+
+  virtual void visit(ArrayAccess &Node) override {
+    if (Scope.find(Node.getArrayName()) == Scope.end())
+      error(Not, Node.getArrayName());
+
+    if (Node.getIndex())
+      Node.getIndex()->accept(*this);
+  };
+
+  virtual void visit(ArraySlice &Node) override {
+    if (Scope.find(Node.getArrayName()) == Scope.end())
+      error(Not, Node.getArrayName());
+
+    if (Node.getLo())
+      Node.getLo()->accept(*this);
+    if (Node.getHi())
+      Node.getHi()->accept(*this);
+  };
+};
+
+// Infers the DataType of every expression, stores it on the node and
+// rejects operands that the code generator cannot lower.
+class TypeCheck : public ASTVisitor {
+  llvm::StringMap<DataType> Types;
+  bool HasError;
+
+  void error(const llvm::Twine &Msg) {
+    llvm::errs() << "Type error: " << Msg << "\n";
+    HasError = true;
+  }
+
+  static const char *typeName(DataType T) {
+    switch (T) {
+      case DataType::Int:
+        return "int";
+      case DataType::Float:
+        return "float";
+      case DataType::Bool:
+        return "bool";
+      case DataType::Array:
+        return "array";
+      default:
+        return "unknown";
+    }
+  }
+
+  static bool isNumeric(DataType T) {
+    return T == DataType::Int || T == DataType::Float;
+  }
+
+  // Int widens to float; everything else must match exactly.
+  static bool isAssignable(DataType To, DataType From) {
+    return To == From || (To == DataType::Float && From == DataType::Int);
+  }
+
+  static DataType promote(DataType L, DataType R) {
+    return (L == DataType::Float || R == DataType::Float) ? DataType::Float
+                                                          : DataType::Int;
+  }
+
+  DataType typeOf(Expr *E) {
+    E->accept(*this);
+    return E->getType();
+  }
+
+  DataType lookup(llvm::StringRef Name) {
+    auto I = Types.find(Name);
+    return I == Types.end() ? DataType::Unknown : I->second;
+  }
+
+  void checkAssign(DataType To, DataType From, llvm::StringRef Var) {
+    if (To != DataType::Unknown && From != DataType::Unknown &&
+        !isAssignable(To, From))
+      error(llvm::Twine("cannot assign ") + typeName(From) + " to " +
+            typeName(To) + " variable " + Var);
+  }
+
+public:
+  TypeCheck() : HasError(false) {}
+
+  bool hasError() { return HasError; }
+
+  virtual void visit(Program &Node) override {
+    for (llvm::SmallVector<AST *>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+    {
+      (*I)->accept(*this);
+    }
+  };
+
+  virtual void visit(Final &Node) override {
+    switch (Node.getKind()) {
+      case Final::Ident:
+        Node.setType(lookup(Node.getVal()));
+        break;
+      case Final::Number:
+        Node.setType(DataType::Int);
+        break;
+      case Final::Float:
+        Node.setType(DataType::Float);
+        break;
+      case Final::Bool:
+        Node.setType(DataType::Bool);
+        break;
+    }
+  };
+
+  virtual void visit(BinaryOp &Node) override {
+    DataType L = typeOf(Node.getLeft());
+    DataType R = typeOf(Node.getRight());
+    // Element-wise over int arrays; an int operand applies to every element
+    if (L == DataType::Array || R == DataType::Array) {
+      if ((L != DataType::Array && L != DataType::Int) ||
+          (R != DataType::Array && R != DataType::Int))
+        error(llvm::Twine("invalid operands ") + typeName(L) + " and " +
+              typeName(R) + " to element-wise operator");
+      Node.setType(DataType::Array);
+      return;
+    }
+    if (!isNumeric(L) || !isNumeric(R)) {
+      error(llvm::Twine("invalid operands ") + typeName(L) + " and " +
+            typeName(R) + " to arithmetic operator");
+      return;
+    }
+    Node.setType(promote(L, R));
+  };
+
+  virtual void visit(UnaryOp &Node) override {
+    DataType T = typeOf(Node.getOperand());
+    if (!isNumeric(T))
+      error(llvm::Twine("cannot increment or decrement ") + typeName(T));
+    Node.setType(T);
+  };
+
+  virtual void visit(Assignment &Node) override {
+    // Array elements are ints
+    DataType To = Node.getElement() ? typeOf(Node.getElement())
+                                    : typeOf(Node.getLeft());
+    DataType From = typeOf(Node.getRight());
+
+    if (Node.getAssignKind() != Assignment::Assign &&
+        (!isNumeric(To) || !isNumeric(From))) {
+      error(llvm::Twine("compound assignment to ") + typeName(To) +
+            " variable " + Node.getLeft()->getVal());
+      return;
+    }
+    checkAssign(To, From, Node.getLeft()->getVal());
+  };
+
+  virtual void visit(SpecialAssignment &Node) override {
+    DataType Dest = lookup(Node.getDest());
+    DataType Arg1 = Node.getArg1().empty() ? Dest : lookup(Node.getArg1());
+    DataType Arg2 = Node.getArg2().empty() ? Arg1 : lookup(Node.getArg2());
+
+    if (Node.getOpKind() == SpecialAssignment::AND ||
+        Node.getOpKind() == SpecialAssignment::OR) {
+      if (Dest != DataType::Bool || Arg1 != DataType::Bool ||
+          Arg2 != DataType::Bool)
+        error(llvm::Twine("AND/OR operands of ") + Node.getDest() +
+              " must be bool");
+      return;
+    }
+
+    if (!isNumeric(Dest) || !isNumeric(Arg1) || !isNumeric(Arg2)) {
+      error(llvm::Twine("arithmetic on non-numeric variable in statement for ") +
+            Node.getDest());
+      return;
+    }
+    checkAssign(Dest, promote(Arg1, Arg2), Node.getDest());
+  };
+
+  virtual void visit(Declaration &Node) override {
+    llvm::SmallVector<Expr *, 8>::const_iterator Val = Node.valBegin();
+    for (llvm::SmallVector<llvm::StringRef, 8>::const_iterator I = Node.varBegin(), E = Node.varEnd(); I != E; ++I) {
+      if (Val != Node.valEnd()) {
+        checkAssign(Node.getType(), typeOf(*Val), *I);
+        ++Val;
+      }
+      Types[*I] = Node.getType();
+    }
+  };
+
+  virtual void visit(Comparison &Node) override {
+    DataType L = typeOf(Node.getLeft());
+    DataType R = typeOf(Node.getRight());
+    if (isNumeric(L) && isNumeric(R))
+      return;
+    bool IsEquality = Node.getOperator() == Comparison::Equal ||
+                      Node.getOperator() == Comparison::Not_equal;
+    if (L == DataType::Bool && R == DataType::Bool && IsEquality)
+      return;
+    error(llvm::Twine("cannot compare ") + typeName(L) + " with " +
+          typeName(R));
+  };
+
+  virtual void visit(LogicalExpr &Node) override {
+    if(Node.getLeft())
+      Node.getLeft()->accept(*this);
+    if(Node.getRight())
+      Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(LogicConst &Node) override {};
+
   virtual void visit(IfStmt &Node) override {
     if (Node.getCond())
       Node.getCond()->accept(*this);
@@ -119,58 +426,855 @@ public:
   };
 
   virtual void visit(ForeachStmt &Node) override {
-    // Add loop variable to scope temporarily
-    Scope.insert(Node.getVar());
+    DataType T = typeOf(Node.getArray());
+    if (T != DataType::Array)
+      error(llvm::Twine("foreach over ") + typeName(T) + " value");
+    for (llvm::SmallVector<llvm::StringRef, 4>::const_iterator I = Node.reductionsBegin(), E = Node.reductionsEnd(); I != E; ++I) {
+      if (!isNumeric(lookup(*I)))
+        error(llvm::Twine("reduction over ") + typeName(lookup(*I)) +
+              " variable " + *I);
+    }
 
-    if (Scope.find(Node.getArray()) == Scope.end())
-      error(Not, Node.getArray());
+    // Arrays hold int elements. The loop variable may shadow an outer
+    // name, whose type comes back once the loop ends
+    llvm::StringMap<DataType>::iterator Outer = Types.find(Node.getVar());
+    bool Shadows = Outer != Types.end();
+    DataType OuterType = Shadows ? Outer->second : DataType::Unknown;
+    Types[Node.getVar()] = DataType::Int;
 
     for (llvm::SmallVector<AST *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I) {
       (*I)->accept(*this);
     }
+
+    if (Shadows)
+      Types[Node.getVar()] = OuterType;
+    else
+      Types.erase(Node.getVar());
   };
 
+  void checkPattern(DataType T, Expr *Pattern) {
+    DataType P = typeOf(Pattern);
+    if (!(isNumeric(T) && isNumeric(P)) && T != P)
+      error(llvm::Twine("match pattern of type ") + typeName(P) +
+            " cannot match " + typeName(T));
+  }
+
+  // Rejects literal alternatives that cover a value twice; the second
+  // one could never be taken.
+  void checkOverlap(MatchStmt &Node) {
+    struct Interval {
+      int64_t Lo, Hi;
+    };
+    llvm::SmallVector<Interval, 16> Intervals;
+    for (llvm::SmallVector<MatchCase *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I) {
+      for (llvm::SmallVector<MatchPattern, 2>::const_iterator P = (*I)->patBegin(), PE = (*I)->patEnd(); P != PE; ++P) {
+        int64_t Lo, Hi;
+        if (!getIntLiteral(P->Lo, Lo) || !getIntLiteral(P->isRange() ? P->Hi : P->Lo, Hi))
+          continue;
+        if (Lo > Hi)
+          error(llvm::Twine("empty range pattern ") + llvm::Twine(Lo) + ".." + llvm::Twine(Hi));
+        else
+          Intervals.push_back({Lo, Hi});
+      }
+    }
+
+    std::sort(Intervals.begin(), Intervals.end(),
+              [](const Interval &A, const Interval &B) { return A.Lo < B.Lo; });
+    for (size_t I = 1; I < Intervals.size(); ++I) {
+      if (Intervals[I].Lo <= Intervals[I - 1].Hi) {
+        error(llvm::Twine("match patterns overlap at ") + llvm::Twine(Intervals[I].Lo));
+        return;
+      }
+      Intervals[I].Hi = std::max(Intervals[I].Hi, Intervals[I - 1].Hi);
+    }
+  }
+
+  // Integer and bool literals, with true and false as 1 and 0.
+  static bool getIntLiteral(Expr *E, int64_t &V) {
+    Final *F = dynCast<Final>(E);
+    if (!F)
+      return false;
+    if (F->getKind() == Final::Bool) {
+      V = F->getVal() == "true";
+      return true;
+    }
+    return F->getKind() == Final::Number && !F->getVal().getAsInteger(10, V);
+  }
+
   virtual void visit(MatchStmt &Node) override {
-    if (Node.getValue())
-      Node.getValue()->accept(*this);
+    DataType T = typeOf(Node.getValue());
+    if (T == DataType::Array)
+      error("cannot match on an array");
 
     for (llvm::SmallVector<MatchCase *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I) {
+      for (llvm::SmallVector<MatchPattern, 2>::const_iterator P = (*I)->patBegin(), PE = (*I)->patEnd(); P != PE; ++P) {
+        checkPattern(T, P->Lo);
+        if (!P->isRange())
+          continue;
+        checkPattern(T, P->Hi);
+        if (!isNumeric(T))
+          error(llvm::Twine("range pattern cannot match ") + typeName(T));
+      }
       (*I)->accept(*this);
     }
+    checkOverlap(Node);
   };
 
   virtual void visit(MatchCase &Node) override {
-    if (Node.getPattern())
-      Node.getPattern()->accept(*this);
-
     for (llvm::SmallVector<AST *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I) {
       (*I)->accept(*this);
     }
   };
 
   virtual void visit(PrintStmt &Node) override {
-    if (Node.getValue())
-      Node.getValue()->accept(*this);
+    if (typeOf(Node.getValue()) == DataType::Array)
+      error("cannot print an array");
   };
 
   virtual void visit(FunctionCall &Node) override {
+    llvm::SmallVector<DataType, 4> Args;
     for (llvm::SmallVector<Expr *, 4>::const_iterator I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I) {
-      (*I)->accept(*this);
+      Args.push_back(typeOf(*I));
+    }
+
+    bool Valid = false;
+    switch (Node.getFunction()) {
+      case FunctionCall::ToInt:
+        Valid = Args.size() == 1 && Args[0] != DataType::Array;
+        Node.setType(DataType::Int);
+        break;
+      case FunctionCall::ToFloat:
+        Valid = Args.size() == 1 && Args[0] != DataType::Array;
+        Node.setType(DataType::Float);
+        break;
+      case FunctionCall::ToBool:
+        Valid = Args.size() == 1 && Args[0] != DataType::Array;
+        Node.setType(DataType::Bool);
+        break;
+      case FunctionCall::Abs:
+        Valid = Args.size() == 1 && isNumeric(Args[0]);
+        Node.setType(Valid ? Args[0] : DataType::Int);
+        break;
+      case FunctionCall::Length:
+        Valid = Args.size() == 1 && Args[0] == DataType::Array;
+        Node.setType(DataType::Int);
+        break;
+      case FunctionCall::Max:
+        // max(arr) reduces an array, max(a, b) picks the larger scalar
+        if (Args.size() == 1) {
+          Valid = Args[0] == DataType::Array;
+          Node.setType(DataType::Int);
+        } else {
+          Valid = Args.size() == 2 && isNumeric(Args[0]) && isNumeric(Args[1]);
+          Node.setType(Valid ? promote(Args[0], Args[1]) : DataType::Int);
+        }
+        break;
+      case FunctionCall::Index:
+      case FunctionCall::Find:
+        Valid = Args.size() == 2 && Args[0] == DataType::Array &&
+                Args[1] == DataType::Int;
+        Node.setType(DataType::Int);
+        break;
+      case FunctionCall::Read:
+        Valid = Args.empty();
+        Node.setType(DataType::Int);
+        break;
+      case FunctionCall::ReadFloat:
+        Valid = Args.empty();
+        Node.setType(DataType::Float);
+        break;
+      case FunctionCall::ReadArray:
+        Valid = Args.size() == 1 && Args[0] == DataType::Int;
+        Node.setType(DataType::Array);
+        break;
     }
+    if (!Valid)
+      error("invalid arguments to builtin function");
   };
 
   virtual void visit(ArrayLiteral &Node) override {
     for (llvm::SmallVector<Expr *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I) {
+      if (typeOf(*I) != DataType::Int)
+        error("array elements must be int");
+    }
+    Node.setType(DataType::Array);
+  };
+
+  virtual void visit(ArrayAccess &Node) override {
+    if (lookup(Node.getArrayName()) != DataType::Array)
+      error(llvm::Twine("cannot index non-array ") + Node.getArrayName());
+    if (typeOf(Node.getIndex()) != DataType::Int)
+      error("array index must be int");
+    Node.setType(DataType::Int);
+  };
+
+  virtual void visit(ArraySlice &Node) override {
+    if (lookup(Node.getArrayName()) != DataType::Array)
+      error(llvm::Twine("cannot slice non-array ") + Node.getArrayName());
+    if (Node.getLo() && typeOf(Node.getLo()) != DataType::Int)
+      error("slice bound must be int");
+    if (Node.getHi() && typeOf(Node.getHi()) != DataType::Int)
+      error("slice bound must be int");
+    Node.setType(DataType::Array);
+  };
+};
+
+// Flow-sensitive definite-assignment analysis. Finds the declarations
+// without an initializer whose zero default is never read, and warns
+// about reads that may see that default.
+class DefiniteAssignment : public ASTVisitor {
+  // Variables that may still hold their default on the current path
+  llvm::StringSet<> Unassigned;
+  llvm::StringMap<Declaration *> Decls;
+  llvm::SmallPtrSet<Declaration *, 16> Seen;
+
+  void read(llvm::StringRef Name) {
+    if (!Unassigned.count(Name))
+      return;
+    Declaration *D = Decls[Name];
+    if (!D->isDefaultObserved())
+      llvm::errs() << "Warning: variable " << Name
+                   << " may be used before it is assigned\n";
+    D->setDefaultObserved(true);
+  }
+
+  void assign(llvm::StringRef Name) { Unassigned.erase(Name); }
+
+  void merge(const llvm::StringSet<> &Other) {
+    for (const auto &Name : Other)
+      Unassigned.insert(Name.getKey());
+  }
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+  // Runs a loop body that executes zero or more times until the set of
+  // possibly unassigned variables at its head stops growing.
+  template <typename BodyFn> void loop(BodyFn Body) {
+    llvm::StringSet<> Head = Unassigned;
+    while (true) {
+      Body();
+      merge(Head);
+      if (Unassigned.size() == Head.size())
+        break;
+      Head = Unassigned;
+    }
+  }
+
+public:
+  virtual void visit(Program &Node) override {
+    for (llvm::SmallVector<AST *>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+    {
+      (*I)->accept(*this);
+    }
+  };
+
+  virtual void visit(Final &Node) override {
+    if (Node.getKind() == Final::Ident)
+      read(Node.getVal());
+  };
+
+  virtual void visit(BinaryOp &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(UnaryOp &Node) override {
+    Node.getOperand()->accept(*this);
+  };
+
+  virtual void visit(Assignment &Node) override {
+    // Storing an element reads the array that holds it
+    if (Node.getElement()) {
+      Node.getElement()->accept(*this);
+      Node.getRight()->accept(*this);
+      return;
+    }
+    if (Node.getAssignKind() != Assignment::Assign)
+      read(Node.getLeft()->getVal());
+    Node.getRight()->accept(*this);
+    assign(Node.getLeft()->getVal());
+  };
+
+  virtual void visit(SpecialAssignment &Node) override {
+    switch (Node.getOpKind()) {
+      case SpecialAssignment::INC:
+      case SpecialAssignment::DEC:
+      case SpecialAssignment::PLE:
+      case SpecialAssignment::MIE:
+        read(Node.getDest());
+        break;
+      default:
+        break;
+    }
+    if (!Node.getArg1().empty())
+      read(Node.getArg1());
+    if (!Node.getArg2().empty())
+      read(Node.getArg2());
+    assign(Node.getDest());
+  };
+
+  virtual void visit(Declaration &Node) override {
+    // Loop bodies are visited more than once; only start from "unobserved"
+    if (Seen.insert(&Node).second)
+      Node.setDefaultObserved(false);
+
+    llvm::SmallVector<Expr *, 8>::const_iterator Val = Node.valBegin();
+    for (llvm::SmallVector<llvm::StringRef, 8>::const_iterator I = Node.varBegin(), E = Node.varEnd(); I != E; ++I) {
+      Decls[*I] = &Node;
+      if (Val != Node.valEnd()) {
+        (*Val)->accept(*this);
+        assign(*I);
+        ++Val;
+      } else {
+        Unassigned.insert(*I);
+      }
+    }
+  };
+
+  virtual void visit(Comparison &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(LogicalExpr &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(LogicConst &Node) override {};
+
+  virtual void visit(IfStmt &Node) override {
+    Node.getCond()->accept(*this);
+
+    llvm::StringSet<> Before = Unassigned;
+    visitStmts(Node.begin(), Node.end());
+    llvm::StringSet<> Then = Unassigned;
+    Unassigned = Before;
+    visitStmts(Node.beginElse(), Node.endElse());
+    merge(Then);
+  };
+
+  virtual void visit(ForStmt &Node) override {
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    loop([&] {
+      if (Node.getCond())
+        Node.getCond()->accept(*this);
+      visitStmts(Node.begin(), Node.end());
+      if (Node.getIncrement())
+        Node.getIncrement()->accept(*this);
+    });
+  };
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.getArray()->accept(*this);
+    // The loop variable gets a slot of its own; an outer variable of the
+    // same name is not written by the loop
+    bool OuterUnassigned = Unassigned.count(Node.getVar());
+    assign(Node.getVar());
+    loop([&] { visitStmts(Node.begin(), Node.end()); });
+    if (OuterUnassigned)
+      Unassigned.insert(Node.getVar());
+  };
+
+  virtual void visit(MatchStmt &Node) override {
+    Node.getValue()->accept(*this);
+
+    llvm::StringSet<> Before = Unassigned;
+    llvm::StringSet<> After;
+    bool HasDefault = false;
+    for (llvm::SmallVector<MatchCase *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I) {
+      Unassigned = Before;
       (*I)->accept(*this);
+      HasDefault |= (*I)->isDefault();
+      for (const auto &Name : Unassigned)
+        After.insert(Name.getKey());
     }
+    // Without a default arm the value may match nothing
+    Unassigned = HasDefault ? After : Before;
+    if (!HasDefault)
+      merge(After);
+  };
+
+  virtual void visit(MatchCase &Node) override {
+    for (llvm::SmallVector<MatchPattern, 2>::const_iterator I = Node.patBegin(), E = Node.patEnd(); I != E; ++I) {
+      I->Lo->accept(*this);
+      if (I->isRange())
+        I->Hi->accept(*this);
+    }
+    visitStmts(Node.begin(), Node.end());
+  };
+
+  virtual void visit(PrintStmt &Node) override {
+    Node.getValue()->accept(*this);
+  };
+
+  virtual void visit(FunctionCall &Node) override {
+    for (llvm::SmallVector<Expr *, 4>::const_iterator I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I)
+      (*I)->accept(*this);
+  };
+
+  virtual void visit(ArrayLiteral &Node) override {
+    for (llvm::SmallVector<Expr *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
   };
 
   virtual void visit(ArrayAccess &Node) override {
-    if (Scope.find(Node.getArrayName()) == Scope.end())
-      error(Not, Node.getArrayName());
+    read(Node.getArrayName());
+    Node.getIndex()->accept(*this);
+  };
 
-    if (Node.getIndex())
-      Node.getIndex()->accept(*this);
+  virtual void visit(ArraySlice &Node) override {
+    read(Node.getArrayName());
+    if (Node.getLo())
+      Node.getLo()->accept(*this);
+    if (Node.getHi())
+      Node.getHi()->accept(*this);
+  };
+};
+
+// Records which variables a subtree reads and which it writes.
+class UseDefCollector : public ASTVisitor {
+  UseDef &Info;
+
+  void use(llvm::StringRef Name) { Info.Uses.insert(Name); }
+  void def(llvm::StringRef Name) { Info.Defs.insert(Name); }
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+  }
+
+public:
+  UseDefCollector(UseDef &Info) : Info(Info) {}
+
+  virtual void visit(Program &Node) override {
+    for (llvm::SmallVector<AST *>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+    {
+      (*I)->accept(*this);
+    }
+  };
+
+  virtual void visit(Final &Node) override {
+    if (Node.getKind() == Final::Ident)
+      use(Node.getVal());
+  };
+
+  virtual void visit(BinaryOp &Node) override {
+    // Arrays of different lengths stop the program
+    if (Node.getType() == DataType::Array)
+      Info.SideEffects = true;
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(UnaryOp &Node) override {
+    // The parser only builds ++/-- around identifiers
+    Node.getOperand()->accept(*this);
+    def(static_cast<Final *>(Node.getOperand())->getVal());
+  };
+
+  virtual void visit(Assignment &Node) override {
+    // An element store changes the buffer, not which buffer the variable
+    // names, so it counts as a use
+    if (Node.getElement()) {
+      Node.getElement()->accept(*this);
+      Node.getRight()->accept(*this);
+      return;
+    }
+    if (Node.getAssignKind() != Assignment::Assign)
+      use(Node.getLeft()->getVal());
+    def(Node.getLeft()->getVal());
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(SpecialAssignment &Node) override {
+    switch (Node.getOpKind()) {
+      case SpecialAssignment::INC:
+      case SpecialAssignment::DEC:
+      case SpecialAssignment::PLE:
+      case SpecialAssignment::MIE:
+        use(Node.getDest());
+        break;
+      default:
+        break;
+    }
+    def(Node.getDest());
+    if (!Node.getArg1().empty())
+      use(Node.getArg1());
+    if (!Node.getArg2().empty())
+      use(Node.getArg2());
+  };
+
+  virtual void visit(Declaration &Node) override {
+    for (llvm::SmallVector<Expr *, 8>::const_iterator I = Node.valBegin(), E = Node.valEnd(); I != E; ++I)
+      (*I)->accept(*this);
+  };
+
+  virtual void visit(Comparison &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(LogicalExpr &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(LogicConst &Node) override {};
+
+  virtual void visit(IfStmt &Node) override {
+    Node.getCond()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+    visitStmts(Node.beginElse(), Node.endElse());
+  };
+
+  virtual void visit(ForStmt &Node) override {
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    if (Node.getCond())
+      Node.getCond()->accept(*this);
+    if (Node.getIncrement())
+      Node.getIncrement()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+  };
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.getArray()->accept(*this);
+    def(Node.getVar());
+    visitStmts(Node.begin(), Node.end());
+  };
+
+  virtual void visit(MatchStmt &Node) override {
+    Node.getValue()->accept(*this);
+    for (llvm::SmallVector<MatchCase *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  };
+
+  virtual void visit(MatchCase &Node) override {
+    for (llvm::SmallVector<MatchPattern, 2>::const_iterator I = Node.patBegin(), E = Node.patEnd(); I != E; ++I) {
+      I->Lo->accept(*this);
+      if (I->isRange())
+        I->Hi->accept(*this);
+    }
+    visitStmts(Node.begin(), Node.end());
+  };
+
+  virtual void visit(PrintStmt &Node) override {
+    Info.SideEffects = true;
+    Node.getValue()->accept(*this);
+  };
+
+  virtual void visit(FunctionCall &Node) override {
+    // Reading consumes input
+    switch (Node.getFunction()) {
+      case FunctionCall::Read:
+      case FunctionCall::ReadFloat:
+      case FunctionCall::ReadArray:
+        Info.SideEffects = true;
+        break;
+      default:
+        break;
+    }
+    for (llvm::SmallVector<Expr *, 4>::const_iterator I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I)
+      (*I)->accept(*this);
+  };
+
+  virtual void visit(ArrayLiteral &Node) override {
+    for (llvm::SmallVector<Expr *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  };
+
+  virtual void visit(ArrayAccess &Node) override {
+    // An out-of-range index stops the program
+    Info.SideEffects = true;
+    use(Node.getArrayName());
+    Node.getIndex()->accept(*this);
+  };
+
+  virtual void visit(ArraySlice &Node) override {
+    // Bounds outside the array stop the program
+    Info.SideEffects = true;
+    use(Node.getArrayName());
+    if (Node.getLo())
+      Node.getLo()->accept(*this);
+    if (Node.getHi())
+      Node.getHi()->accept(*this);
+  };
+};
+
+// Rejects parallel foreach bodies whose iterations could interfere. A body
+// may read anything, but it only writes its own variables, and the shared
+// ones named in reduce(...) only by adding to them.
+class ParallelCheck : public ASTVisitor {
+  struct Frame {
+    llvm::StringSet<> Declared;   // Loop variable and body declarations
+    llvm::StringSet<> Reductions;
+  };
+  // One frame per enclosing parallel foreach, innermost last
+  llvm::SmallVector<Frame, 2> Frames;
+  // Names in scope, to tell a foreach that reuses one from a fresh one
+  llvm::StringSet<> Scope;
+  // Names in Scope in declaration order, so a block can drop its own
+  llvm::SmallVector<llvm::StringRef, 16> Declared;
+  bool HasError;
+
+  void error(const llvm::Twine &Msg) {
+    llvm::errs() << "Parallel error: " << Msg << "\n";
+    HasError = true;
+  }
+
+  bool isShared(llvm::StringRef Name) {
+    return !Frames.empty() && !Frames.back().Declared.count(Name);
+  }
+
+  bool isReduction(llvm::StringRef Name) {
+    return !Frames.empty() && Frames.back().Reductions.count(Name);
+  }
+
+  void read(llvm::StringRef Name) {
+    if (isReduction(Name))
+      error(llvm::Twine("reduction variable ") + Name +
+            " is read inside the loop");
+  }
+
+  void write(llvm::StringRef Name) {
+    if (isShared(Name))
+      error(llvm::Twine("shared variable ") + Name +
+            " is assigned inside the loop");
+  }
+
+  // A copy or slice of a shared array shares its elements as well
+  bool viewsShared(Expr *Value) {
+    if (ArraySlice *View = dynCast<ArraySlice>(Value))
+      return isShared(View->getArrayName());
+    Final *F = dynCast<Final>(Value);
+    return F && F->getKind() == Final::Ident &&
+           F->getType() == DataType::Array && isShared(F->getVal());
+  }
+
+  // x += e, x -= e, x++ and x--: partial sums combine in any order
+  void accumulate(llvm::StringRef Name) {
+    if (isShared(Name) && !isReduction(Name))
+      write(Name);
+  }
+
+  size_t enterBlock() { return Declared.size(); }
+
+  void leaveBlock(size_t Mark) {
+    while (Declared.size() > Mark)
+      Scope.erase(Declared.pop_back_val());
+  }
+
+  void visitStmts(llvm::SmallVector<AST *, 8>::const_iterator I,
+                  llvm::SmallVector<AST *, 8>::const_iterator E) {
+    size_t Mark = enterBlock();
+    for (; I != E; ++I)
+      (*I)->accept(*this);
+    leaveBlock(Mark);
+  }
+
+public:
+  ParallelCheck() : HasError(false) {}
+
+  bool hasError() { return HasError; }
+
+  virtual void visit(Program &Node) override {
+    for (llvm::SmallVector<AST *>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+    {
+      (*I)->accept(*this);
+    }
+  };
+
+  virtual void visit(Final &Node) override {
+    if (Node.getKind() == Final::Ident)
+      read(Node.getVal());
+  };
+
+  virtual void visit(BinaryOp &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(UnaryOp &Node) override {
+    // The parser only builds ++/-- around identifiers; the old value is
+    // the result, so the operand is read as well
+    Node.getOperand()->accept(*this);
+    write(static_cast<Final *>(Node.getOperand())->getVal());
+  };
+
+  virtual void visit(Assignment &Node) override {
+    llvm::StringRef Dest = Node.getLeft()->getVal();
+    if (Node.getElement()) {
+      if (isShared(Dest))
+        error(llvm::Twine("element of shared array ") + Dest +
+              " is assigned inside the loop");
+      Node.getElement()->getIndex()->accept(*this);
+    } else if (Node.getAssignKind() == Assignment::Plus_assign ||
+               Node.getAssignKind() == Assignment::Minus_assign) {
+      accumulate(Dest);
+    } else {
+      if (Node.getAssignKind() != Assignment::Assign)
+        read(Dest);
+      write(Dest);
+      if (!Frames.empty() && viewsShared(Node.getRight()))
+        Frames.back().Declared.erase(Dest);
+    }
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(SpecialAssignment &Node) override {
+    switch (Node.getOpKind()) {
+      case SpecialAssignment::INC:
+      case SpecialAssignment::DEC:
+      case SpecialAssignment::PLE:
+      case SpecialAssignment::MIE:
+        accumulate(Node.getDest());
+        break;
+      default:
+        write(Node.getDest());
+        break;
+    }
+    if (!Node.getArg1().empty())
+      read(Node.getArg1());
+    if (!Node.getArg2().empty())
+      read(Node.getArg2());
+  };
+
+  virtual void visit(Declaration &Node) override {
+    for (llvm::SmallVector<Expr *, 8>::const_iterator I = Node.valBegin(), E = Node.valEnd(); I != E; ++I)
+      (*I)->accept(*this);
+    llvm::SmallVector<Expr *, 8>::const_iterator Val = Node.valBegin();
+    for (llvm::SmallVector<llvm::StringRef, 8>::const_iterator I = Node.varBegin(), E = Node.varEnd(); I != E; ++I) {
+      if (Scope.insert(*I).second)
+        Declared.push_back(*I);
+      if (!Frames.empty() && !(Val != Node.valEnd() && viewsShared(*Val)))
+        Frames.back().Declared.insert(*I);
+      if (Val != Node.valEnd())
+        ++Val;
+    }
+  };
+
+  virtual void visit(Comparison &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(LogicalExpr &Node) override {
+    Node.getLeft()->accept(*this);
+    Node.getRight()->accept(*this);
+  };
+
+  virtual void visit(LogicConst &Node) override {};
+
+  virtual void visit(IfStmt &Node) override {
+    Node.getCond()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+    visitStmts(Node.beginElse(), Node.endElse());
+  };
+
+  virtual void visit(ForStmt &Node) override {
+    size_t Mark = enterBlock();
+    if (Node.getInit())
+      Node.getInit()->accept(*this);
+    if (Node.getCond())
+      Node.getCond()->accept(*this);
+    if (Node.getIncrement())
+      Node.getIncrement()->accept(*this);
+    visitStmts(Node.begin(), Node.end());
+    leaveBlock(Mark);
+  };
+
+  virtual void visit(ForeachStmt &Node) override {
+    Node.getArray()->accept(*this);
+    size_t Mark = enterBlock();
+    if (!Node.isParallel()) {
+      if (Scope.insert(Node.getVar()).second) {
+        Declared.push_back(Node.getVar());
+        if (!Frames.empty())
+          Frames.back().Declared.insert(Node.getVar());
+      }
+      write(Node.getVar());
+      visitStmts(Node.begin(), Node.end());
+      leaveBlock(Mark);
+      return;
+    }
+
+    // A nested parallel loop adds its reductions up into the enclosing body
+    for (llvm::SmallVector<llvm::StringRef, 4>::const_iterator I = Node.reductionsBegin(), E = Node.reductionsEnd(); I != E; ++I)
+      accumulate(*I);
+
+    Frames.emplace_back();
+    Frames.back().Declared.insert(Node.getVar());
+    if (Scope.insert(Node.getVar()).second)
+      Declared.push_back(Node.getVar());
+    for (llvm::SmallVector<llvm::StringRef, 4>::const_iterator I = Node.reductionsBegin(), E = Node.reductionsEnd(); I != E; ++I) {
+      if (*I == Node.getVar() || !Frames.back().Reductions.insert(*I).second)
+        error(llvm::Twine("invalid reduction variable ") + *I);
+    }
+    visitStmts(Node.begin(), Node.end());
+    Frames.pop_back();
+    leaveBlock(Mark);
+  };
+
+  virtual void visit(MatchStmt &Node) override {
+    Node.getValue()->accept(*this);
+    for (llvm::SmallVector<MatchCase *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  };
+
+  virtual void visit(MatchCase &Node) override {
+    for (llvm::SmallVector<MatchPattern, 2>::const_iterator I = Node.patBegin(), E = Node.patEnd(); I != E; ++I) {
+      I->Lo->accept(*this);
+      if (I->isRange())
+        I->Hi->accept(*this);
+    }
+    visitStmts(Node.begin(), Node.end());
+  };
+
+  virtual void visit(PrintStmt &Node) override {
+    // Output would interleave in no particular order
+    if (!Frames.empty())
+      error("print inside a parallel loop");
+    Node.getValue()->accept(*this);
+  };
+
+  virtual void visit(FunctionCall &Node) override {
+    switch (Node.getFunction()) {
+      case FunctionCall::Read:
+      case FunctionCall::ReadFloat:
+      case FunctionCall::ReadArray:
+        if (!Frames.empty())
+          error("reading input inside a parallel loop");
+        break;
+      default:
+        break;
+    }
+    for (llvm::SmallVector<Expr *, 4>::const_iterator I = Node.argsBegin(), E = Node.argsEnd(); I != E; ++I)
+      (*I)->accept(*this);
+  };
+
+  virtual void visit(ArrayLiteral &Node) override {
+    for (llvm::SmallVector<Expr *, 8>::const_iterator I = Node.begin(), E = Node.end(); I != E; ++I)
+      (*I)->accept(*this);
+  };
+
+  virtual void visit(ArrayAccess &Node) override {
+    read(Node.getArrayName());
+    Node.getIndex()->accept(*this);
+  };
+
+  virtual void visit(ArraySlice &Node) override {
+    read(Node.getArrayName());
+    if (Node.getLo())
+      Node.getLo()->accept(*this);
+    if (Node.getHi())
+      Node.getHi()->accept(*this);
   };
 };
 }
@@ -180,5 +1284,27 @@ bool Sema::semantic(Program *Tree) {
     return false;
   nms::InputCheck *Check = new nms::InputCheck();
   Tree->accept(*Check);
-  return Check->hasError();
+  if (Check->hasError())
+    return true;
+
+  nms::TypeCheck *Types = new nms::TypeCheck();
+  Tree->accept(*Types);
+  if (Types->hasError())
+    return true;
+
+  nms::ParallelCheck *Parallel = new nms::ParallelCheck();
+  Tree->accept(*Parallel);
+  if (Parallel->hasError())
+    return true;
+
+  nms::DefiniteAssignment *Assigned = new nms::DefiniteAssignment();
+  Tree->accept(*Assigned);
+  return false;
 }
+
+UseDef Sema::useDef(AST *Node) {
+  UseDef Info;
+  nms::UseDefCollector Collector(Info);
+  Node->accept(Collector);
+  return Info;
+}
\ No newline at end of file
@@ -3,10 +3,22 @@
 
 #include "AST.h"
 #include "Lexer.h"
+#include "llvm/ADT/StringSet.h"
+
+// Variables a subtree reads (Uses) and writes after declaration (Defs),
+// and whether it does anything else observable: output or a bounds trap.
+struct UseDef {
+  llvm::StringSet<> Uses;
+  llvm::StringSet<> Defs;
+  bool SideEffects = false;
+};
 
 class Sema {
 public:
   bool semantic(Program *Tree);
+
+  // Collects use/def information for Node; valid once semantic() succeeded.
+  static UseDef useDef(AST *Node);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Language tests for the compiler
+
+Every tests/NAME.txt is a program. It is compiled, linked against the
+runtime the way run.sh does it, and run; what it prints must equal
+NAME.out. Optional files next to it:
+  NAME.flags  extra compiler options, e.g. --auto-parallel
+  NAME.in     standard input of the program
+  NAME.err    text the compiler or the program must print to stderr
+              before exiting with an error
+
+Usage: run_tests.py COMPILER [NAME ...]   (all tests without NAME)
+"""
+
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(TESTS_DIR)
+RUNTIME = ["rtCompiler.c", "rtArray.c", "rtParallel.c"]
+
+CC = os.environ.get("CC", "cc")
+LLC = os.environ.get("LLC", "llc")
+
+
+def read(path, default=None):
+    if not os.path.exists(path):
+        return default
+    with open(path) as f:
+        return f.read()
+
+
+def build_runtime(work_dir):
+    objects = []
+    for source in RUNTIME:
+        obj = os.path.join(work_dir, source.replace(".c", ".o"))
+        subprocess.run([CC, "-O2", "-pthread", "-c", "-o", obj,
+                        os.path.join(ROOT_DIR, source)], check=True)
+        objects.append(obj)
+    return objects
+
+
+def failed(name, message, got=None):
+    print(f"✗ {name}: FAILED - {message}")
+    if got is not None:
+        print(f"  Got:\n{got}")
+    return False
+
+
+def run_test(compiler, runtime, work_dir, name):
+    """Compile, link and run one program and check its output"""
+    base = os.path.join(TESTS_DIR, name)
+    program = read(base + ".txt")
+    if program is None:
+        return failed(name, "no such test")
+    flags = read(base + ".flags", "").split()
+    stdin = read(base + ".in", "")
+    expected = read(base + ".out", "")
+    error = read(base + ".err")
+    env = dict(os.environ)
+    # Enough threads to split a parallel loop even on one core
+    env.setdefault("RT_THREADS", "4")
+
+    ir = os.path.join(work_dir, name + ".ll")
+    obj = os.path.join(work_dir, name + ".o")
+    exe = os.path.join(work_dir, name)
+    with open(ir, "w") as out:
+        compiled = subprocess.run([compiler] + flags + [program], stdout=out,
+                                  stderr=subprocess.PIPE, text=True)
+    if compiled.returncode != 0:
+        if error is not None and error.strip() in compiled.stderr:
+            print(f"✓ {name}: PASSED")
+            return True
+        return failed(name, "compilation failed", compiled.stderr)
+
+    for step in ([LLC, "--filetype=obj", "--relocation-model=pic", "-o=" + obj, ir],
+                 [CC, "-o", exe, obj] + runtime + ["-lm", "-pthread"]):
+        built = subprocess.run(step, capture_output=True, text=True)
+        if built.returncode != 0:
+            return failed(name, os.path.basename(step[0]) + " failed", built.stderr)
+
+    try:
+        result = subprocess.run([exe], input=stdin, capture_output=True, text=True,
+                                env=env, timeout=60)
+    except subprocess.TimeoutExpired:
+        return failed(name, "timeout")
+
+    if result.stdout != expected:
+        print(f"✗ {name}: FAILED")
+        print(f"  Expected:\n{expected}")
+        print(f"  Got:\n{result.stdout}")
+        return False
+    if error is None and result.returncode != 0:
+        return failed(name, f"exit code {result.returncode}", result.stderr)
+    if error is not None and (result.returncode == 0 or error.strip() not in result.stderr):
+        return failed(name, f"expected error '{error.strip()}'", result.stderr)
+    print(f"✓ {name}: PASSED")
+    return True
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        return 2
+    compiler = os.path.abspath(sys.argv[1])
+    names = sys.argv[2:] or sorted(f[:-4] for f in os.listdir(TESTS_DIR)
+                                   if f.endswith(".txt"))
+
+    work_dir = tempfile.mkdtemp(prefix="compiler-tests-")
+    try:
+        runtime = build_runtime(work_dir)
+        passed = sum(run_test(compiler, runtime, work_dir, name) for name in names)
+    finally:
+        shutil.rmtree(work_dir)
+
+    print(f"{passed}/{len(names)} tests passed")
+    return 0 if passed == len(names) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())